@@ -0,0 +1,328 @@
+/**
+ * @file bench.cpp
+ * Microbenchmarks of the internals of remake.
+ *
+ * The program is compiled together with remake.cpp, so that it can call
+ * its static functions. It generates synthetic projects in a temporary
+ * directory: linear chains of targets, wide fan-in/fan-out graphs, deep
+ * chains of generic rules, and large databases. For each benchmark, it
+ * prints one JSON object per line:
+ *
+ * @verbatim
+{"bench":"parse_rules","case":"chain","n":10000,"iterations":42,"ns_per_op":4761904}
+@endverbatim
+ *
+ * The full and no-op builds are performed by the remake executable passed as
+ * first argument, which defaults to <tt>./remake</tt>. The sizes can be
+ * scaled down by a factor passed as second argument, e.g. for quick checks.
+ */
+
+#define main remake_main
+#include "../remake.cpp"
+#undef main
+
+/**
+ * Path to the remake executable used for the builds.
+ */
+static std::string remake_exe;
+
+/**
+ * Divisor applied to the sizes of the generated projects.
+ */
+static int scale = 1;
+
+/**
+ * Get a monotonic date in nanoseconds.
+ */
+static file_time bench_clock()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (file_time)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+/**
+ * Print the result of a benchmark.
+ */
+static void report(char const *bench, char const *name, int n, int iterations, file_time elapsed)
+{
+	std::cout << "{\"bench\":\"" << bench << "\",\"case\":\"" << name
+		<< "\",\"n\":" << n << ",\"iterations\":" << iterations
+		<< ",\"ns_per_op\":" << elapsed / iterations << '}' << std::endl;
+}
+
+/**
+ * Call @a f repeatedly for about a fifth of a second, then report the
+ * average time taken by one call.
+ */
+template <class F>
+static void measure(char const *bench, char const *name, int n, F f)
+{
+	int iterations = 0;
+	file_time begin = bench_clock(), elapsed;
+	do
+	{
+		f();
+		++iterations;
+		elapsed = bench_clock() - begin;
+	}
+	while (elapsed < 200000000);
+	report(bench, name, n, iterations, elapsed);
+}
+
+/**
+ * Run remake with @a args in the current directory and report how long
+ * it took. Abort on failure.
+ */
+static void time_build(char const *bench, char const *name, int n, std::string const &args)
+{
+	std::string cmd = remake_exe + " -s " + args + " > /dev/null";
+	file_time begin = bench_clock();
+	if (system(cmd.c_str()) != 0)
+	{
+		std::cerr << "Failed to run " << cmd << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	report(bench, name, n, 1, bench_clock() - begin);
+}
+
+/**
+ * Create an empty directory @a dir, switch to it, and forget about the
+ * rules and dependencies of the previous project.
+ */
+static void enter_project(std::string const &dir)
+{
+	if (mkdir(dir.c_str(), 0777) || chdir(dir.c_str()))
+	{
+		perror("Failed to create project");
+		exit(EXIT_FAILURE);
+	}
+	init_working_dir();
+	reload_rules("/dev/null");
+	dependencies.assign(dependencies.size(), ref_ptr<dependency_t>());
+	reverse_dependencies.assign(reverse_dependencies.size(), id_list());
+	status.assign(status.size(), status_t());
+	prefetched.clear();
+}
+
+/**
+ * Go back to the parent directory of the current project.
+ */
+static void leave_project()
+{
+	if (chdir(".."))
+	{
+		perror("Failed to leave project");
+		exit(EXIT_FAILURE);
+	}
+}
+
+/**
+ * Parse the rules of the current project, without going through the cache
+ * file, neither to read it nor to write it.
+ */
+struct bench_parse_rules
+{
+	std::string content;
+	bench_parse_rules()
+	{
+		std::ostringstream buf;
+		std::ifstream in("Remakefile");
+		buf << in.rdbuf();
+		content = buf.str();
+	}
+	void operator()() const
+	{
+		reload_rules("/dev/null");
+		memory_stream in(content.data(), content.data() + content.size());
+		string_list options;
+		parse_rules(in, options);
+		cached_rules.clear();
+		index_generic_rules();
+	}
+};
+
+/**
+ * Load the rules of the current project from the cache file.
+ */
+struct bench_load_cached_rules
+{
+	bench_load_cached_rules() { reload_rules("Remakefile"); }
+	void operator()() const { reload_rules("Remakefile"); }
+};
+
+/**
+ * Load the database of the current project.
+ */
+struct bench_load_dependencies
+{
+	void operator()() const
+	{
+		// Keep the loaded database from being rewritten on exit.
+		database_obsolete = false;
+		load_dependencies();
+	}
+};
+
+/**
+ * Check the status of @a target from scratch.
+ */
+struct bench_get_status
+{
+	target_id target;
+	bench_get_status(target_id t): target(t) {}
+	void operator()() const
+	{
+		status.assign(status.size(), status_t());
+		prefetched.clear();
+		get_status(target);
+	}
+};
+
+/**
+ * Look up the generic rule building @a target, without memoization.
+ */
+struct bench_find_generic_rule
+{
+	target_id target;
+	bench_find_generic_rule(target_id t): target(t) {}
+	void operator()() const
+	{
+		// Measure the lookup, not its memoized result.
+		generic_matches.clear();
+		job_t job;
+		find_generic_rule(job, target);
+		assert(!job.rule.empty());
+	}
+};
+
+/**
+ * Substitute the variables into the script of @a job.
+ */
+struct bench_prepare_script
+{
+	job_t job;
+	bench_prepare_script(job_t const &j): job(j) {}
+	void operator()() const { prepare_script(job); }
+};
+
+/**
+ * Linear chain of @a n targets, each one depending on the previous one.
+ */
+static void chain(int n)
+{
+	enter_project("chain");
+	{
+		std::ofstream out("Remakefile");
+		out << "c0:\n\ttouch $@\n";
+		for (int i = 1; i < n; ++i)
+			out << 'c' << i << ": c" << i - 1 << "\n\ttouch $@\n";
+	}
+	measure("parse_rules", "chain", n, bench_parse_rules());
+	measure("load_cached_rules", "chain", n, bench_load_cached_rules());
+	std::ostringstream last;
+	last << 'c' << n - 1;
+	time_build("full_build", "chain", n, last.str());
+	time_build("noop_build", "chain", n, last.str());
+	load_dependencies();
+	measure("get_status", "chain", n, bench_get_status(intern(last.str())));
+	leave_project();
+}
+
+/**
+ * A source file used by @a n objects, all of them used by a single target.
+ */
+static void fan(int n)
+{
+	enter_project("fan");
+	{
+		std::ofstream out("Remakefile");
+		out << "all:";
+		for (int i = 0; i < n; ++i) out << " f" << i << ".o";
+		out << "\n\tcat $^ > $@\n\n%.o: src\n\techo $@ > $@\n\nsrc:\n\ttouch $@\n";
+	}
+	measure("parse_rules", "fan", n, bench_parse_rules());
+	measure("load_cached_rules", "fan", n, bench_load_cached_rules());
+	time_build("full_build", "fan", n, "-j8");
+	time_build("noop_build", "fan", n, "-j8");
+	load_dependencies();
+	measure("get_status", "fan", n, bench_get_status(intern("all")));
+	leave_project();
+}
+
+/**
+ * Chain of @a n generic rules, each one building a suffix from the
+ * previous one, next to as many unrelated generic rules.
+ */
+static void generic(int n)
+{
+	enter_project("generic");
+	{
+		std::ofstream out("Remakefile");
+		out << "VAR = some words to substitute\n\n";
+		for (int i = 0; i < n; ++i)
+			out << "%.u" << i << ": %.v" << i << "\n\tcat $< > $@\n\n";
+		out << "%.s0:\n\techo $(VAR) $* > $@\n\n";
+		for (int i = 1; i < n; ++i)
+			out << "%.s" << i << ": %.s" << i - 1 << "\n\tcat $< > $@\n\techo $(VAR) $* >> $@\n\n";
+	}
+	measure("parse_rules", "generic", n, bench_parse_rules());
+	measure("load_cached_rules", "generic", n, bench_load_cached_rules());
+	std::ostringstream last;
+	last << "x.s" << n - 1;
+	measure("find_generic_rule", "generic", n, bench_find_generic_rule(intern(last.str())));
+	job_t job;
+	find_rule(job, intern(last.str()));
+	measure("prepare_script", "generic", n, bench_prepare_script(job));
+	time_build("full_build", "generic", n, last.str());
+	time_build("noop_build", "generic", n, last.str());
+	leave_project();
+}
+
+/**
+ * Database of @a n targets, each one with a few prerequisites.
+ */
+static void database(int n)
+{
+	enter_project("database");
+	{
+		std::ostringstream out;
+		for (int i = 0; i < n; ++i)
+		{
+			out << "obj/d" << i << ".o: src/d" << i << ".c include/h"
+				<< i % 100 << ".h include/common.h\n";
+		}
+		std::istringstream in(out.str());
+		load_dependencies(in);
+		database_obsolete = true;
+		save_dependencies();
+	}
+	measure("load_dependencies", "database", n, bench_load_dependencies());
+	leave_project();
+}
+
+/**
+ * Run all the benchmarks in a temporary directory.
+ */
+int main(int argc, char *argv[])
+{
+	char buf[1024];
+	if (!getcwd(buf, sizeof(buf))) return EXIT_FAILURE;
+	remake_exe = argc > 1 ? argv[1] : "./remake";
+	if (remake_exe[0] != '/') remake_exe = std::string(buf) + '/' + remake_exe;
+	if (argc > 2) scale = std::max(1, atoi(argv[2]));
+
+	char tmpl[] = "/tmp/remake-bench-XXXXXX";
+	if (!mkdtemp(tmpl) || chdir(tmpl))
+	{
+		perror("Failed to create temporary directory");
+		return EXIT_FAILURE;
+	}
+	chain(2000 / scale);
+	fan(2000 / scale);
+	generic(200 / scale);
+	database(100000 / scale);
+	if (chdir("/")) return EXIT_FAILURE;
+	std::string cmd = std::string("rm -rf ") + tmpl;
+	return system(cmd.c_str()) == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
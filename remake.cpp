@@ -75,14 +75,66 @@ Usage: <tt>remake <i>options</i> <i>targets</i></tt>
 
 Options:
 
+- <tt>--affected</tt>: Print the targets that depend on the files passed on
+  the command line, as recorded by previous builds, and exit.
 - <tt>-B</tt>, <tt>--always-make</tt>: Unconditionally make all targets.
 - <tt>-d</tt>: Echo script commands.
+- <tt>--daemon</tt>: Keep serving build requests from this directory.
 - <tt>-f FILE</tt>: Read <tt>FILE</tt> as <b>Remakefile</b>.
 - <tt>-j[N]</tt>, <tt>--jobs=[N]</tt>: Allow <tt>N</tt> jobs at once;
   infinite jobs with no argument.
 - <tt>-k</tt>, <tt>--keep-going</tt>: Keep going when some targets cannot be made.
+- <tt>-l\[N\]</tt>, <tt>--load-average=\[N\]</tt>: Do not start new jobs
+  while the load is above <tt>N</tt>; on Linux, the load is the number of
+  threads currently runnable.
+- <tt>--memory-headroom=N</tt>: Do not start new jobs while less than
+  <tt>N</tt> megabytes of memory are available, or while the system is
+  reclaiming memory. On Linux only, taking cgroup limits into account.
+- <tt>-O</tt>, <tt>--output-sync</tt>: Capture the output of each script
+  and display it in one piece once the script has ended, just before its
+  <tt>Finished</tt> or <tt>Failed to build</tt> line.
 - <tt>-r</tt>: Look up targets from the dependencies on standard input.
 - <tt>-s</tt>, <tt>--silent</tt>, <tt>--quiet</tt>: Do not echo targets.
+- <tt>--trace=FILE</tt>: Write a timeline of the build to <tt>FILE</tt>, in
+  the trace event format of Chrome, which Perfetto can display.
+
+When started with <tt>--daemon</tt>, <b>remake</b> loads the rules and the
+dependencies, then waits for build requests instead of building anything.
+Any later call to <b>remake</b> from the same directory sends its targets
+and its options to the daemon, which builds them with its rules and
+dependencies already in memory; the output of the scripts goes to the
+calling process. Except for debugging, the options passed to the daemon
+itself do not matter. Scripts run in the environment of the daemon, and
+neither variables nor options <tt>-f</tt> and <tt>--trace</tt> can be
+given on the command line. The rules are reloaded whenever
+<b>Remakefile</b> changes. The daemon exits on <tt>SIGTERM</tt> or
+<tt>SIGINT</tt>.
+
+When started from a recipe of GNU make with no <tt>-j</tt> option,
+<b>remake</b> takes part in the jobserver of make: every job beyond the first
+one needs a token from it. Otherwise, when several jobs are allowed,
+<b>remake</b> creates a jobserver itself and advertises it in
+<tt>MAKEFLAGS</tt>, so that GNU make or ninja started by the scripts share
+the same number of jobs.
+
+Once parsed, the rules are stored into <tt>.remake.rules</tt>. As long as
+the content of <b>Remakefile</b> and the variables set on the command line
+stay the same, later runs load the rules from this file instead of parsing
+<b>Remakefile</b> again. The file can be removed at any time.
+
+The timeline written by <tt>--trace</tt> shows the loading and saving of
+<tt>.remake</tt>, the loading of <b>Remakefile</b>, and the initial check of
+the targets. Each job is shown from the time it is started, including the
+building of its static prerequisites, to its completion; it contains the run
+of its script, which itself contains the times the script spends waiting for
+build requests. The events carry the job number and the targets. When given
+to a daemon, the option traces all the requests it serves.
+
+When started with <tt>--affected</tt>, <b>remake</b> builds nothing. The
+command-line arguments are taken as file names, and all the targets that
+transitively depend on them are printed, one per line. The dependencies come
+from <b>Remakefile</b> and from <tt>.remake</tt>, so dynamic dependencies
+are only known once the targets have been built at least once.
 
 \section sec-syntax Syntax
 
@@ -192,6 +244,14 @@ Target <tt>.PHONY</tt> marks its prerequisites as being always obsolete.
 
 \subsection sec-special-var Special variables
 
+Variable <tt>.WEIGHT</tt> gives the number of job slots (see option
+<tt>-j</tt>) used by a script, 1 by default. It is typically set for
+specific targets of generic rules:
+
+@verbatim
+huge.o: .WEIGHT = 4
+@endverbatim
+
 Variable <tt>.OPTIONS</tt> is handled specially. Its content enables some
 features of <b>remake</b> that are not enabled by default.
 
@@ -200,6 +260,19 @@ features of <b>remake</b> that are not enabled by default.
   depends on. This option also enables variables to be set on the command
   line. Note that, as in <b>make</b>, this features introduces non-determinism:
   the content of some variables will depend on the build order.
+- <tt>checksum</tt>: A target is no longer considered obsolete because its
+  prerequisites are more recent, but only if their content changed since it
+  was built. Similarly, a target that is rebuilt with an unchanged content
+  does not cause the targets depending on it to be rebuilt. The content
+  hashes are stored in <tt>.remake</tt> and a file is hashed again only when
+  its size, its date, or its inode changes.
+- <tt>cache</tt>: After a script succeeds, its targets are copied into
+  directory <tt>.remake.cache</tt>, or the one named by the
+  <tt>REMAKE_CACHE</tt> environment variable. When the same script is later
+  run with prerequisites of the same content, e.g. after switching branches,
+  the targets are restored from this directory instead. Only scripts whose
+  output depends on nothing but their prerequisites should be cached. The
+  directory can be removed at any time.
 
 \section sec-semantics Semantics
 
@@ -284,7 +357,7 @@ The set of rules from <b>Remakefile</b> is ill-formed:
 
 \section sec-compilation Compilation
 
-- On Linux, MacOSX, and BSD: <tt>g++ -o remake remake.cpp</tt>
+- On Linux, MacOSX, and BSD: <tt>g++ -pthread -o remake remake.cpp</tt>
 - On Windows: <tt>g++ -o remake.exe remake.cpp -lws2_32</tt>
 
 Installing <b>remake</b> is needed only if <b>Remakefile</b> does not
@@ -292,6 +365,12 @@ specify the path to the executable for its recursive calls. Thanks to its
 single source file, <b>remake</b> can be shipped inside other packages and
 built at configuration time.
 
+The <tt>bench</tt> target of the <b>Remakefile</b> of <b>remake</b> itself
+runs microbenchmarks of its internals on generated projects: the loading of
+rules and databases, the status checks, the lookup of generic rules, the
+preparation of scripts, and full and no-op builds. The results are printed
+as one JSON object per line.
+
 \section sec-differences Differences with other build systems
 
 Differences with <b>make</b>:
@@ -328,8 +407,8 @@ Remakefile: Remakefile.in ./config.status
   <b>redo</b> though, if its obsolete status would be due to a dynamic
   prerequisite, it will go unnoticed; it should be removed beforehand.
 - Multiple targets are supported.
-- <b>remake</b> has almost no features: no checksum-based dependencies, no
-  compatibility with job servers, etc.
+- <b>remake</b> has almost no features: checksum-based dependencies are
+  optional, no VPATH, etc.
 
 \section sec-limitations Limitations
 
@@ -372,9 +451,28 @@ spawned them. They then wait for completion and exit with the status
 returned by the server. This is handled by #client_mode.
 
 The server calls #load_dependencies and #save_dependencies to serialize
-dynamic dependencies from <b>.remake</b>. It loads <b>Remakefile</b> with
+dynamic dependencies from <b>.remake</b>. This database is stored in a
+binary format (see #db_version) that is memory-mapped when loaded, so that
+it does not need to be tokenized. Changes are appended to
+<b>.remake.journal</b> as soon as they are known, by #run_script and
+#parse_client_message; the journal is folded into <b>.remake</b> only once it has
+grown large enough. It loads <b>Remakefile</b> with
 #load_rules. It then runs #server_mode, which calls #server_loop.
 
+#server_loop waits for readable descriptors registered with #watch_fd and
+calls their handlers. On Linux, it relies on epoll and receives SIGCHLD
+through a signal descriptor, so that the cost of an event does not depend
+on the number of running jobs. Elsewhere, or if epoll is not available, it
+falls back to pselect.
+
+With <tt>--daemon</tt>, #main calls #daemon_mode instead, which keeps the
+server alive. Top-level remake processes then act as clients too; they
+send a negative job id, which makes #handle_connection queue their request
+in #daemon_requests. #serve_request handles them one at a time. Before
+each request, #invalidate_status follows #reverse_dependencies from the
+files that changed, so that only the targets depending on them are checked
+again.
+
 When building a target, the following sequence of events happens:
 
 - #start calls #find_rule (and #find_generic_rule) to get the rule.
@@ -384,8 +482,9 @@ When building a target, the following sequence of events happens:
 - #run_script creates a shell process and stores it in #job_pids. It
   increases #running_jobs.
 - The child process possibly calls <b>remake</b> with a list of targets.
-- #accept_client receives a build request from a child process and adds
-  it to #clients. It also records the new dependencies of the job into
+- #accept_client accepts a connection from a child process. Its request
+  is parsed by #handle_connection as it arrives and then added to
+  #clients. The new dependencies of the job are recorded into
   #dependencies. It increases #waiting_jobs.
 - #handle_clients uses #get_status to look up the obsoleteness of the
   targets.
@@ -395,7 +494,7 @@ When building a target, the following sequence of events happens:
 - If the build targets come from a pseudo-client, #complete_request calls
   #run_script. Otherwise it sends the reply to the corresponding child
   process and decreases #waiting_jobs.
-- When a child process ends, #server_loop calls #finalize_job, which
+- When a child process ends, #reap_children calls #finalize_job, which
   removes the process from #job_pids, decreases #running_jobs, and calls
   #complete_job.
 - #complete_job removes the job from #jobs and calls #update_status
@@ -408,8 +507,10 @@ When building a target, the following sequence of events happens:
 #define WINDOWS
 #endif
 
+#include <algorithm>
 #include <fstream>
 #include <iostream>
+#include <iterator>
 #include <list>
 #include <map>
 #include <set>
@@ -423,6 +524,7 @@ When building a target, the following sequence of events happens:
 #include <errno.h>
 #include <fcntl.h>
 #include <signal.h>
+#include <stdint.h>
 #include <unistd.h>
 #include <sys/stat.h>
 #include <sys/types.h>
@@ -435,6 +537,14 @@ When building a target, the following sequence of events happens:
 #define LINUX
 #endif
 
+#ifdef LINUX
+#include <linux/fs.h>
+#include <sys/epoll.h>
+#include <sys/inotify.h>
+#include <sys/ioctl.h>
+#include <sys/signalfd.h>
+#endif
+
 #ifdef WINDOWS
 #include <windows.h>
 #include <winbase.h>
@@ -442,6 +552,9 @@ When building a target, the following sequence of events happens:
 #define pid_t HANDLE
 typedef SOCKET socket_t;
 #else
+#include <pthread.h>
+#include <spawn.h>
+#include <sys/mman.h>
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <sys/wait.h>
@@ -454,9 +567,20 @@ extern char **environ;
 enum { MSG_NOSIGNAL = 0 };
 #endif
 
+#ifndef O_BINARY
+enum { O_BINARY = 0 };
+#endif
+
 typedef std::list<std::string> string_list;
 
-typedef std::set<std::string> string_set;
+/**
+ * Dense identifier of a target, as returned by #intern.
+ */
+typedef int target_id;
+
+typedef std::vector<target_id> id_list;
+
+typedef std::set<target_id> id_set;
 
 /**
  * Reference-counted shared object.
@@ -492,23 +616,38 @@ struct ref_ptr
 		return ptr->val;
 	}
 	T *operator->() const { return &**this; }
+	bool empty() const { return !ptr; }
 };
 
 struct dependency_t
 {
-	string_list targets;
-	string_set deps;
+	id_list targets; ///< Targets sharing these dependencies.
+	id_list deps;    ///< Sorted prerequisites.
 };
 
-typedef std::map<std::string, ref_ptr<dependency_t> > dependency_map;
+typedef std::vector<ref_ptr<dependency_t> > dependency_map;
 
 typedef std::map<std::string, string_list> variable_map;
 
+/**
+ * Frame of local variables, overlaid on the ones of the enclosing frame and,
+ * ultimately, on the global #variables. Frames are shared by the jobs and
+ * clients that inherit them, so they are never modified once populated.
+ */
+struct variable_frame_t
+{
+	variable_map vars;                ///< Variables set by this frame.
+	ref_ptr<variable_frame_t> parent; ///< Enclosing frame, if any.
+};
+
+typedef ref_ptr<variable_frame_t> variable_scope;
+
 /**
  * Build status of a target.
  */
 enum status_e
 {
+	Unknown,  ///< Target has not been checked yet.
 	Uptodate, ///< Target is up-to-date.
 	Todo,     ///< Target is missing or obsolete.
 	Recheck,  ///< Target has an obsolete dependency.
@@ -518,16 +657,35 @@ enum status_e
 	Failed    ///< Build failed for target.
 };
 
+/**
+ * Modification date of a file, in nanoseconds since the epoch.
+ */
+typedef int64_t file_time;
+
 /**
  * Build status of a target.
  */
 struct status_t
 {
 	status_e status; ///< Actual status.
-	time_t last;     ///< Last-modified date.
+	file_time last;  ///< Last-modified date.
+	status_t(): status(Unknown), last(0) {}
 };
 
-typedef std::map<std::string, status_t> status_map;
+typedef std::vector<status_t> status_map;
+
+/**
+ * Content hash of a file, as used by the <tt>checksum</tt> option.
+ * The hash is trusted as long as the size, the modification date, and the
+ * inode number of the file are the ones it was computed for.
+ */
+struct file_hash_t
+{
+	uint64_t size, mtime, ino; ///< Stamp of the file when it was hashed.
+	uint64_t hash;   ///< Hash of the content; zero if unknown.
+	uint64_t inputs; ///< Combined hash of the prerequisites the file was built from; zero if unknown.
+	file_hash_t(): size(0), mtime(0), ino(0), hash(0), inputs(0) {}
+};
 
 /**
  * Delayed assignment to a variable.
@@ -540,6 +698,28 @@ struct assign_t
 
 typedef std::map<std::string, assign_t> assign_map;
 
+/**
+ * Piece of a compiled script.
+ */
+struct script_segment_t
+{
+	enum kind_e
+	{
+		Literal,    ///< Text copied as is.
+		Target,     ///< <tt>$@</tt>
+		FirstDep,   ///< <tt>$<</tt>
+		AllDeps,    ///< <tt>$^</tt>
+		Stem,       ///< <tt>$*</tt>
+		Variable,   ///< <tt>$(name)</tt>
+		Expression  ///< Any other <tt>$(...)</tt>, e.g. a function call.
+	};
+	kind_e kind;
+	std::string text; ///< Literal text, variable name, or expression.
+	script_segment_t(kind_e k, std::string const &t = std::string()): kind(k), text(t) {}
+};
+
+typedef std::vector<script_segment_t> script_template;
+
 /**
  * A rule loaded from Remakefile.
  */
@@ -550,11 +730,12 @@ struct rule_t
 	string_list wdeps;   ///< Like #deps, except that they are not registered as dependencies.
 	assign_map assigns;  ///< Assignment of variables.
 	std::string script;  ///< Shell script for building the targets.
+	ref_ptr<script_template> compiled; ///< #script, as compiled by #compile_script, shared by the copies of the rule.
 };
 
 typedef std::list<rule_t> rule_list;
 
-typedef std::map<std::string, ref_ptr<rule_t> > rule_map;
+typedef std::vector<ref_ptr<rule_t> > rule_map;
 
 /**
  * A job created from a set of rules.
@@ -562,9 +743,27 @@ typedef std::map<std::string, ref_ptr<rule_t> > rule_map;
 
 struct job_t
 {
-	rule_t rule;       ///< Original rule.
-	std::string stem;  ///< Pattern used to instantiate the generic rule, if any.
-	variable_map vars; ///< Values of local variables.
+	ref_ptr<rule_t> rule; ///< Original rule, shared with #specific_rules or #generic_rules and never modified.
+	std::string stem;     ///< Pattern used to instantiate the generic rule, if any.
+	string_list targets;  ///< Targets of the instantiated generic rule, empty for a specific rule.
+	string_list deps;     ///< Dependencies of the instantiated generic rule, followed by the ones of the merged specific rules.
+	string_list wdeps;    ///< Like #deps, except that they are not registered as dependencies.
+	assign_map assigns;   ///< Assignments of the merged specific rules.
+	variable_scope vars;  ///< Values of local variables.
+	file_time start;      ///< Date at which the script was started.
+	int weight;           ///< Number of job slots used by the script.
+	int waiting;          ///< Number of build requests from the script being served.
+	int output[2];        ///< Files capturing the standard output and error of the script, or -1.
+	job_t(): start(0), weight(1), waiting(0) { output[0] = output[1] = -1; }
+
+	/**
+	 * Accessors to the targets, dependencies, and assignments of the job,
+	 * whether they come from a specific rule or from an instantiated one.
+	 */
+	string_list const &get_targets() const { return targets.empty() ? rule->targets : targets; }
+	string_list const &get_deps() const { return targets.empty() ? rule->deps : deps; }
+	string_list const &get_wdeps() const { return targets.empty() ? rule->wdeps : wdeps; }
+	assign_map const &get_assigns() const { return targets.empty() ? rule->assigns : assigns; }
 };
 
 typedef std::map<int, job_t> job_map;
@@ -590,14 +789,30 @@ struct client_t
 	int job_id;          ///< Job for which the built script called remake and spawned the client (negative for original clients).
 	bool failed;         ///< Whether some targets failed in mode -k.
 	string_list pending; ///< Targets not yet started.
-	string_set running;  ///< Targets being built.
-	variable_map vars;   ///< Variables set on request.
+	id_set running;      ///< Targets being built.
+	variable_scope vars; ///< Variables set on request.
 	bool delayed;        ///< Whether it is a dependency client and a script has to be started on request completion.
 	client_t(): socket(INVALID_SOCKET), job_id(-1), failed(false), delayed(false) {}
 };
 
 typedef std::list<client_t> client_list;
 
+/**
+ * Connection from a client whose request has not been fully received.
+ */
+struct connection_t
+{
+	std::string buf;       ///< Data received but not parsed yet.
+	client_t client;       ///< Request being received.
+	bool has_job_id;       ///< Whether the job id has been received.
+	string_list *last_var; ///< Variable being assigned by the last record.
+	string_list options;   ///< Options of a top-level request.
+	std::vector<int> fds;  ///< Output descriptors of a top-level request.
+	connection_t(): has_job_id(false), last_var(NULL) {}
+};
+
+typedef std::map<socket_t, connection_t> connection_map;
+
 /**
  * Map from variable names to their content.
  * Initialized with the values passed on the command line.
@@ -605,22 +820,104 @@ typedef std::list<client_t> client_list;
 static variable_map variables;
 
 /**
- * Map from targets to their known dependencies.
+ * Names of the targets, indexed by their identifiers.
+ */
+static std::vector<std::string> target_names;
+
+/**
+ * Open-addressing hash table from names to identifiers of targets.
+ * Empty slots are negative. Its size is a power of two.
+ */
+static std::vector<target_id> target_index;
+
+/**
+ * Known dependencies, indexed by target identifiers.
+ * Targets with no known dependencies have an empty pointer.
  */
 static dependency_map dependencies;
 
 /**
- * Map from targets to their build status.
+ * Reverse edges of #dependencies, indexed by target identifiers: the
+ * sorted list of the targets whose dependencies contain a given target.
+ */
+static std::vector<id_list> reverse_dependencies;
+
+/**
+ * Build status, indexed by target identifiers.
  */
 static status_map status;
 
+/**
+ * Wall-clock durations in milliseconds of the last successful scripts
+ * building each target, indexed by target identifiers.
+ */
+static std::vector<unsigned> durations;
+
+/**
+ * Estimated times in milliseconds needed to build each target and its
+ * obsolete prerequisites, indexed by target identifiers. Negative when
+ * not computed yet.
+ * @see critical_path
+ */
+static std::vector<int> critical_paths;
+
+/**
+ * Content hashes of files, indexed by target identifiers.
+ * They are kept in the database even when the <tt>checksum</tt> option is
+ * not enabled.
+ */
+static std::vector<file_hash_t> file_hashes;
+
+/**
+ * Targets marked as phony by the rules.
+ */
+static id_list phony_targets;
+
 /**
  * Set of generic rules loaded from Remakefile.
  */
-static rule_list generic_rules;
+static rule_map generic_rules;
+
+/**
+ * Target pattern of a generic rule.
+ */
+struct generic_pattern_t
+{
+	int rule;                   ///< Index of the generic rule the pattern belongs to.
+	std::string const *pattern; ///< Target of the rule.
+	size_t prefix;              ///< Position of the percent character.
+	size_t length;              ///< Length of the pattern, percent character included.
+};
+
+/**
+ * Target patterns of #generic_rules, in the order of the rules and of
+ * their targets.
+ */
+static std::vector<generic_pattern_t> generic_patterns;
+
+/**
+ * Node of a trie of the suffixes of #generic_patterns read backward.
+ */
+struct suffix_node_t
+{
+	std::map<char, int> next;  ///< Child nodes, by previous character.
+	std::vector<int> patterns; ///< Patterns whose suffix ends at this node.
+};
+
+/**
+ * Trie of the suffixes of #generic_patterns, rooted at the first node.
+ */
+static std::vector<suffix_node_t> suffix_trie;
+
+/**
+ * Pattern of #generic_patterns chosen for each target, -1 if there is
+ * none, or -2 if not yet looked up.
+ */
+static std::vector<int> generic_matches;
 
 /**
- * Map from targets to specific rules loaded from Remakefile.
+ * Specific rules loaded from Remakefile, indexed by target identifiers.
+ * Targets with no specific rules have an empty pointer.
  */
 static rule_map specific_rules;
 
@@ -637,15 +934,68 @@ static pid_job_map job_pids;
 /**
  * List of clients waiting for a request to complete.
  * New clients are put to front, so that the build process is depth-first.
+ * The pending targets of a client are ordered by #prioritize.
  */
 static client_list clients;
 
+/**
+ * Client connections whose request is still being received.
+ */
+static connection_map connections;
+
+/**
+ * Top-level requests received by the daemon and not yet served.
+ */
+static std::list<connection_t> daemon_requests;
+
 /**
  * Maximum number of parallel jobs (non-positive if unbounded).
  * Can be modified by the -j option.
  */
 static int max_active_jobs = 1;
 
+/**
+ * Load above which no new jobs are started (non-positive if unbounded).
+ * Can be modified by the -l option.
+ */
+static double max_load = 0;
+
+/**
+ * Memory in megabytes below which no new jobs are started (zero if
+ * unbounded). Can be modified by the --memory-headroom option.
+ */
+static long memory_headroom = 0;
+
+/**
+ * Number of job slots used by the running jobs that are not waiting for a
+ * build request to finish. A job uses as many slots as its weight.
+ */
+static int busy_slots = 0;
+
+/**
+ * Whether #has_free_slots refused to start a job because of the load or of
+ * the memory, in which case they have to be checked again later.
+ */
+static bool throttled = false;
+
+#ifndef WINDOWS
+/**
+ * Descriptor of the GNU make jobserver, or -1 if there is none. Each job
+ * beyond the first one needs a token read from it.
+ */
+static int jobserver_fd = -1;
+
+/**
+ * Tokens read from #jobserver_fd, to be written back once not needed.
+ */
+static std::string jobserver_tokens;
+
+/**
+ * Name of the fifo of the jobserver created for the scripts, if any.
+ */
+static std::string jobserver_fifo;
+#endif
+
 /**
  * Whether to keep building targets in case of failure.
  * Can be modified by the -k option.
@@ -679,6 +1029,34 @@ static int waiting_jobs = 0;
  */
 static int job_counter = 0;
 
+/**
+ * File descriptor of the dependency journal, once opened for appending.
+ */
+static int journal_fd = -1;
+
+/**
+ * Size in bytes of the dependency journal.
+ */
+static size_t journal_size = 0;
+
+/**
+ * Size in bytes of the dependency database, as last loaded or saved.
+ */
+static size_t database_size = 0;
+
+/**
+ * Whether the dependency database has to be fully rewritten on exit,
+ * whatever the size of the journal.
+ */
+static bool database_obsolete = false;
+
+/**
+ * Journal records for the entries of #file_hashes and #durations that
+ * changed. They are only written on exit, since losing them just causes
+ * files to be hashed again or jobs to be scheduled less efficiently.
+ */
+static std::string pending_records;
+
 /**
  * Socket on which the server listens for client request.
  */
@@ -694,6 +1072,31 @@ static bool build_failure;
  * Name of the server socket in the file system.
  */
 static char *socket_name;
+
+/**
+ * Environment of the job scripts: the environment of remake deprived of
+ * REMAKE_JOB_ID, then a slot for the variable of the current job, then a
+ * null pointer. Empty until the first job is started.
+ */
+static std::vector<char *> job_env;
+
+/**
+ * Handler called by #server_loop when a watched descriptor is readable.
+ */
+typedef void (*fd_handler)(int fd);
+
+/**
+ * Handlers of the descriptors watched by #server_loop, indexed by
+ * descriptor. Null if a descriptor is not watched.
+ */
+static std::vector<fd_handler> fd_handlers;
+#endif
+
+#ifdef LINUX
+/**
+ * Epoll instance used by #server_loop, or -1 if it falls back to pselect.
+ */
+static int epoll_fd = -1;
 #endif
 
 /**
@@ -712,9 +1115,15 @@ static bool show_targets = true;
 static bool echo_scripts = false;
 
 /**
- * Time at the start of the program.
+ * Whether the output of each script is captured and displayed only once
+ * the script has ended, so that the output of parallel jobs does not mix.
+ */
+static bool sync_output = false;
+
+/**
+ * Time at the start of the program, or of the current daemon request.
  */
-static time_t now = time(NULL);
+static file_time now;
 
 /**
  * Directory with respect to which command-line names are relative.
@@ -736,19 +1145,44 @@ static bool changed_prefix_dir;
  */
 static bool propagate_vars = false;
 
+/**
+ * Whether obsolescence is decided by comparing content hashes rather than
+ * modification dates, when the hashes are known.
+ */
+static bool checksums = false;
+
+/**
+ * Whether the targets of scripts are stored into and restored from the
+ * build cache.
+ */
+static bool use_cache = false;
+
 /**
  * Whether targets are unconditionally obsolete.
  */
 static bool obsolete_targets = false;
 
+/**
+ * Whether the server runs as a daemon (see #daemon_mode).
+ */
+static bool daemon_server = false;
+
 #ifndef WINDOWS
 static volatile sig_atomic_t got_SIGCHLD = 0;
+static volatile sig_atomic_t got_SIGTERM = 0;
 
 static void sigchld_handler(int)
 {
 	got_SIGCHLD = 1;
 }
 
+static void sigterm_handler(int)
+{
+	// Let the daemon finish the current request and exit.
+	got_SIGTERM = 1;
+	keep_going = false;
+}
+
 static void sigint_handler(int)
 {
 	// Child processes will receive the signal too, so just prevent
@@ -803,147 +1237,350 @@ struct log_auto_close
 #define DEBUG_close if ((auto_close.still_open = false), debug.active) debug(false)
 
 /**
- * Strong typedef for strings that need escaping.
- * @note The string is stored as a reference, so the constructed object is
- *       meant to be immediately consumed.
+ * File receiving the build timeline as Chrome trace events, if any.
+ */
+static FILE *trace_file = NULL;
+
+/**
+ * Get a monotonic date in nanoseconds for tracing.
  */
-struct escape_string
+static file_time trace_clock()
 {
-	std::string const &input;
-	escape_string(std::string const &s): input(s) {}
-};
+#ifdef WINDOWS
+	return (file_time)GetTickCount() * 1000000;
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (file_time)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
 
 /**
- * Write the string in @a se to @a out if it does not contain any special
- * characters, a quoted and escaped string otherwise.
+ * Write string @a s to the trace, as a JSON string.
  */
-static std::ostream &operator<<(std::ostream &out, escape_string const &se)
+static void trace_string(std::string const &s)
 {
-	std::string const &s = se.input;
-	char const *quoted_char = ",: '";
-	char const *escaped_char = "\"\\$!";
-	bool need_quotes = false;
-	char *buf = NULL;
-	size_t len = s.length(), last = 0, j = 0;
-	for (size_t i = 0; i < len; ++i)
+	putc('"', trace_file);
+	for (std::string::const_iterator i = s.begin(), i_end = s.end(); i != i_end; ++i)
 	{
-		if (strchr(escaped_char, s[i]))
-		{
-			need_quotes = true;
-			if (!buf) buf = new char[len * 2];
-			memcpy(&buf[j], &s[last], i - last);
-			j += i - last;
-			buf[j++] = '\\';
-			buf[j++] = s[i];
-			last = i + 1;
-		}
-		if (!need_quotes && strchr(quoted_char, s[i]))
-			need_quotes = true;
+		unsigned char c = *i;
+		if (c == '"' || c == '\\') fprintf(trace_file, "\\%c", c);
+		else if (c < 0x20) fprintf(trace_file, "\\u%04x", c);
+		else putc(c, trace_file);
 	}
-	if (!need_quotes) return out << s;
-	out << '"';
-	if (!buf) return out << s << '"';
-	out.write(buf, j);
-	out.write(&s[last], len - last);
-	delete[] buf;
-	return out << '"';
+	putc('"', trace_file);
 }
 
 /**
- * @defgroup paths Path helpers
- *
- * @{
+ * Start a trace event of phase @a ph named @a name at date @a ts.
+ * The caller adds more fields, then closes the event with a brace.
  */
+static void trace_event(char ph, char const *name, file_time ts)
+{
+	static bool first = true;
+	fputs(first ? "[\n" : ",\n", trace_file);
+	first = false;
+	fprintf(trace_file, "{\"name\":\"%s\",\"ph\":\"%c\",\"ts\":%.3f,\"pid\":%d,\"tid\":0",
+		name, ph, ts / 1000.0, (int)getpid());
+}
 
 /**
- * Initialize #working_dir.
+ * Record that phase @a name of the server has run since @a begin.
  */
-static void init_working_dir()
+static void trace_phase(char const *name, file_time begin)
 {
-	char buf[1024];
-	char *res = getcwd(buf, sizeof(buf));
-	if (!res)
-	{
-		perror("Failed to get working directory");
-		exit(EXIT_FAILURE);
-	}
-	working_dir = buf;
-#ifdef WINDOWS
-	for (size_t i = 0, l = working_dir.size(); i != l; ++i)
-	{
-		if (working_dir[i] == '\\') working_dir[i] = '/';
-	}
-#endif
-	prefix_dir = working_dir;
+	if (!trace_file) return;
+	file_time end = trace_clock();
+	trace_event('X', name, begin);
+	fprintf(trace_file, ",\"cat\":\"server\",\"dur\":%.3f}", (end - begin) / 1000.0);
 }
 
 /**
- * Initialize #prefix_dir and switch to it.
+ * Record the beginning (@a ph is <tt>b</tt>) or the end (<tt>e</tt>) of
+ * step @a name of job @a job_id building @a targets. The steps of a job
+ * nest: the whole job, the script, and its waits for build requests.
  */
-static void init_prefix_dir()
+static void trace_job(char ph, char const *name, int job_id, string_list const &targets)
 {
-	for (;;)
+	if (!trace_file) return;
+	trace_event(ph, name, trace_clock());
+	fprintf(trace_file, ",\"cat\":\"job\",\"id\":%d", job_id);
+	if (ph == 'b')
 	{
-		struct stat s;
-		if (stat((prefix_dir + "/Remakefile").c_str(), &s) == 0)
-		{
-			if (!changed_prefix_dir) return;
-			if (chdir(prefix_dir.c_str()))
-			{
-				perror("Failed to change working directory");
-				exit(EXIT_FAILURE);
-			}
-			if (show_targets)
-			{
-				std::cout << "remake: Entering directory `" << prefix_dir << '\'' << std::endl;
-			}
-			return;
-		}
-		size_t pos = prefix_dir.find_last_of('/');
-		if (pos == std::string::npos)
+		std::string t;
+		for (string_list::const_iterator i = targets.begin(),
+		     i_end = targets.end(); i != i_end; ++i)
 		{
-			std::cerr << "Failed to locate Remakefile in the current directory or one of its parents" << std::endl;
-			exit(EXIT_FAILURE);
+			if (!t.empty()) t += ' ';
+			t += *i;
 		}
-		prefix_dir.erase(pos);
-		changed_prefix_dir = true;
+		fprintf(trace_file, ",\"args\":{\"job\":%d,\"targets\":", job_id);
+		trace_string(t);
+		putc('}', trace_file);
 	}
+	putc('}', trace_file);
 }
 
 /**
- * Normalize an absolute path with respect to @a p.
- * Paths outside the subtree are left unchanged.
+ * Record a phase of the server spanning the lifetime of the object.
  */
-static std::string normalize_abs(std::string const &s, std::string const &p)
+struct trace_scope
 {
-	size_t l = p.length();
-	if (s.compare(0, l, p)) return s;
-	size_t ll = s.length();
-	if (ll == l) return ".";
-	if (s[l] != '/')
+	char const *name;
+	file_time begin;
+	trace_scope(char const *n): name(n), begin(trace_file ? trace_clock() : 0)
 	{
-		size_t pos = s.rfind('/', l);
-		assert(pos != std::string::npos);
-		return s.substr(pos + 1);
 	}
-	if (ll == l + 1) return ".";
-	return s.substr(l + 1);
+	~trace_scope()
+	{
+		trace_phase(name, begin);
+	}
+};
+
+/**
+ * Start tracing the build into file @a name.
+ */
+static void open_trace(std::string const &name)
+{
+	trace_file = fopen(name.c_str(), "w");
+	if (trace_file) return;
+	std::cerr << "Failed to open " << name << std::endl;
+	exit(EXIT_FAILURE);
 }
 
 /**
- * Normalize path @a s (possibly relative to @a w) with respect to @a p.
+ * Terminate the trace, if any.
+ */
+static void close_trace()
+{
+	if (!trace_file) return;
+	fputs("\n]\n", trace_file);
+	fclose(trace_file);
+	trace_file = NULL;
+}
+
+/**
+ * @defgroup targets Target identifiers
  *
- * - If both @a p and @a w are empty, the function just removes ".", "..", "//".
- * - If only @a p is empty, the function returns an absolute path.
+ * @{
  */
-static std::string normalize(std::string const &s, std::string const &w, std::string const &p)
+
+/**
+ * Hash @a s with the FNV-1a function.
+ */
+static size_t hash_name(std::string const &s)
 {
-#ifdef WINDOWS
-	char const *delim = "/\\";
-#else
-	char delim = '/';
-#endif
-	size_t pos = s.find_first_of(delim);
+	size_t h = 2166136261u;
+	for (size_t i = 0, l = s.length(); i != l; ++i)
+	{
+		h = (h ^ (unsigned char)s[i]) * 16777619u;
+	}
+	return h;
+}
+
+/**
+ * Return the slot of #target_index containing @a name, or the empty slot
+ * where it should be inserted.
+ */
+static size_t find_slot(std::string const &name)
+{
+	size_t mask = target_index.size() - 1;
+	for (size_t i = hash_name(name) & mask;; i = (i + 1) & mask)
+	{
+		target_id t = target_index[i];
+		if (t < 0 || target_names[t] == name) return i;
+	}
+}
+
+/**
+ * Return the identifier of target @a name, or a negative value if it has
+ * never been interned.
+ */
+static target_id find_target(std::string const &name)
+{
+	if (target_index.empty()) return -1;
+	return target_index[find_slot(name)];
+}
+
+/**
+ * Return the identifier of target @a name, creating it if needed.
+ * Tables indexed by identifiers are extended accordingly.
+ * @note References into these tables are invalidated.
+ */
+static target_id intern(std::string const &name)
+{
+	if (target_names.size() * 2 >= target_index.size())
+	{
+		target_index.assign(std::max<size_t>(1024, target_index.size() * 2), -1);
+		for (size_t i = 0, l = target_names.size(); i != l; ++i)
+		{
+			target_index[find_slot(target_names[i])] = i;
+		}
+	}
+	size_t i = find_slot(name);
+	if (target_index[i] >= 0) return target_index[i];
+	target_id t = target_names.size();
+	target_index[i] = t;
+	target_names.push_back(name);
+	dependencies.resize(t + 1);
+	reverse_dependencies.resize(t + 1);
+	status.resize(t + 1);
+	file_hashes.resize(t + 1);
+	durations.resize(t + 1);
+	critical_paths.resize(t + 1, -1);
+	specific_rules.resize(t + 1);
+	return t;
+}
+
+/**
+ * Append the identifiers of the targets from @a src to @a dst.
+ */
+static void intern_list(string_list const &src, id_list &dst)
+{
+	for (string_list::const_iterator i = src.begin(),
+	     i_end = src.end(); i != i_end; ++i)
+	{
+		dst.push_back(intern(*i));
+	}
+}
+
+/**
+ * Insert target @a t into the sorted list @a l, if not already present.
+ */
+static void insert_sorted(id_list &l, target_id t)
+{
+	id_list::iterator i = std::lower_bound(l.begin(), l.end(), t);
+	if (i == l.end() || *i != t) l.insert(i, t);
+}
+
+/**
+ * Add the targets from @a src into the sorted list @a l.
+ */
+static void insert_sorted(id_list &l, string_list const &src)
+{
+	intern_list(src, l);
+	std::sort(l.begin(), l.end());
+	l.erase(std::unique(l.begin(), l.end()), l.end());
+}
+
+/**
+ * Remove target @a t from the sorted list @a l, if present.
+ */
+static void erase_sorted(id_list &l, target_id t)
+{
+	id_list::iterator i = std::lower_bound(l.begin(), l.end(), t);
+	if (i != l.end() && *i == t) l.erase(i);
+}
+
+/**
+ * Add the targets from the sorted list @a src into the sorted list @a l.
+ */
+static void insert_sorted(id_list &l, id_list const &src)
+{
+	id_list res;
+	res.reserve(l.size() + src.size());
+	std::set_union(l.begin(), l.end(), src.begin(), src.end(),
+		std::back_inserter(res));
+	l.swap(res);
+}
+
+/** @} */
+
+/**
+ * @defgroup paths Path helpers
+ *
+ * @{
+ */
+
+/**
+ * Initialize #working_dir.
+ */
+static void init_working_dir()
+{
+	char buf[1024];
+	char *res = getcwd(buf, sizeof(buf));
+	if (!res)
+	{
+		perror("Failed to get working directory");
+		exit(EXIT_FAILURE);
+	}
+	working_dir = buf;
+#ifdef WINDOWS
+	for (size_t i = 0, l = working_dir.size(); i != l; ++i)
+	{
+		if (working_dir[i] == '\\') working_dir[i] = '/';
+	}
+#endif
+	prefix_dir = working_dir;
+}
+
+/**
+ * Initialize #prefix_dir and switch to it.
+ */
+static void init_prefix_dir()
+{
+	for (;;)
+	{
+		struct stat s;
+		if (stat((prefix_dir + "/Remakefile").c_str(), &s) == 0)
+		{
+			if (!changed_prefix_dir) return;
+			if (chdir(prefix_dir.c_str()))
+			{
+				perror("Failed to change working directory");
+				exit(EXIT_FAILURE);
+			}
+			if (show_targets)
+			{
+				std::cout << "remake: Entering directory `" << prefix_dir << '\'' << std::endl;
+			}
+			return;
+		}
+		size_t pos = prefix_dir.find_last_of('/');
+		if (pos == std::string::npos)
+		{
+			std::cerr << "Failed to locate Remakefile in the current directory or one of its parents" << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		prefix_dir.erase(pos);
+		changed_prefix_dir = true;
+	}
+}
+
+/**
+ * Normalize an absolute path with respect to @a p.
+ * Paths outside the subtree are left unchanged.
+ */
+static std::string normalize_abs(std::string const &s, std::string const &p)
+{
+	size_t l = p.length();
+	if (s.compare(0, l, p)) return s;
+	size_t ll = s.length();
+	if (ll == l) return ".";
+	if (s[l] != '/')
+	{
+		size_t pos = s.rfind('/', l);
+		assert(pos != std::string::npos);
+		return s.substr(pos + 1);
+	}
+	if (ll == l + 1) return ".";
+	return s.substr(l + 1);
+}
+
+/**
+ * Normalize path @a s (possibly relative to @a w) with respect to @a p.
+ *
+ * - If both @a p and @a w are empty, the function just removes ".", "..", "//".
+ * - If only @a p is empty, the function returns an absolute path.
+ */
+static std::string normalize(std::string const &s, std::string const &w, std::string const &p)
+{
+#ifdef WINDOWS
+	char const *delim = "/\\";
+#else
+	char delim = '/';
+#endif
+	size_t pos = s.find_first_of(delim);
 	if (pos == std::string::npos && w == p) return s;
 	bool absolute = pos == 0;
 	if (!absolute && w != p && !w.empty())
@@ -1004,6 +1641,75 @@ static void normalize_list(string_list &l, std::string const &w, std::string con
  * @{
  */
 
+/**
+ * Stream buffer over a block of memory, e.g. a mapped file. Reading from
+ * it never refills the buffer, and the lexer scans it directly.
+ */
+struct memory_buf: std::streambuf
+{
+	memory_buf(char const *b, char const *e)
+	{
+		setg((char *)b, (char *)b, (char *)e);
+	}
+	char const *cur() const { return gptr(); }
+	char const *end() const { return egptr(); }
+	void skip(size_t n) { gbump(n); }
+	static memory_buf *of(std::istream &in);
+};
+
+/**
+ * Buffers of the streams the lexer is reading from memory. They are
+ * registered by #memory_stream, so that the lexer does not have to
+ * inspect the type of every stream buffer it gets.
+ */
+static std::vector<memory_buf *> memory_bufs;
+
+/**
+ * Get the buffer of stream @a in if it reads from memory, or NULL.
+ */
+memory_buf *memory_buf::of(std::istream &in)
+{
+	std::streambuf *b = in.rdbuf();
+	for (std::vector<memory_buf *>::const_iterator i = memory_bufs.begin(),
+	     i_end = memory_bufs.end(); i != i_end; ++i)
+	{
+		if (*i == b) return *i;
+	}
+	return NULL;
+}
+
+/**
+ * Input stream over a block of memory.
+ */
+struct memory_stream: std::istream
+{
+	memory_buf buf;
+	memory_stream(char const *b, char const *e): std::istream(NULL), buf(b, e)
+	{
+		init(&buf);
+		memory_bufs.push_back(&buf);
+	}
+	~memory_stream()
+	{
+		memory_bufs.erase(std::find(memory_bufs.begin(), memory_bufs.end(), &buf));
+	}
+};
+
+/**
+ * Return whether @a c ends an unquoted word.
+ */
+static bool is_separator(int c)
+{
+	switch (c)
+	{
+	case '\0': case ' ': case '\t': case '\r': case '\n':
+	case '$': case '(': case ')': case ',': case ':':
+		return true;
+	default:
+		return false;
+	}
+}
+
 /**
  * Skip spaces.
  */
@@ -1108,12 +1814,22 @@ static std::string read_word(std::istream &in, bool detect_equal = true)
 	int c = in.peek();
 	std::string res;
 	if (!in.good()) return res;
-	char const *separators = " \t\r\n$(),:";
 	bool quoted = c == '"';
 	if (quoted) in.ignore(1);
 	bool plus = false;
+	memory_buf *mem = memory_buf::of(in);
 	while (true)
 	{
+		if (mem && !quoted && !plus)
+		{
+			// Take all the ordinary characters at once.
+			char const *b = mem->cur(), *e = mem->end(), *p = b;
+			while (p != e && !is_separator((unsigned char)*p) &&
+			       (!detect_equal || (*p != '=' && *p != '+')))
+				++p;
+			res.append(b, p - b);
+			mem->skip(p - b);
+		}
 		c = in.peek();
 		if (!in.good()) return res;
 		if (quoted)
@@ -1137,7 +1853,7 @@ static std::string read_word(std::istream &in, bool detect_equal = true)
 			res += '+';
 			plus = false;
 		}
-		if (strchr(separators, c)) return res;
+		if (is_separator(c)) return res;
 		in.ignore(1);
 		if (detect_equal && c == '+') plus = true;
 		else res += c;
@@ -1171,6 +1887,24 @@ struct generator
 	virtual input_status next(std::string &) = 0;
 };
 
+/**
+ * Find the value of variable @a name, looking first into the frames of
+ * @a scope, if any, from the innermost one, then into the global #variables.
+ * @return NULL if the variable is not set.
+ */
+static string_list const *find_variable(variable_scope const *scope, std::string const &name)
+{
+	for (; scope && !scope->empty(); scope = &(*scope)->parent)
+	{
+		variable_map const &vars = (*scope)->vars;
+		variable_map::const_iterator i = vars.find(name);
+		if (i != vars.end()) return &i->second;
+	}
+	variable_map::const_iterator i = variables.find(name);
+	if (i == variables.end()) return NULL;
+	return &i->second;
+}
+
 /**
  * Generator for the words of a variable.
  */
@@ -1178,27 +1912,17 @@ struct variable_generator: generator
 {
 	std::string name;
 	string_list::const_iterator vcur, vend;
-	variable_generator(std::string const &, variable_map const *);
+	variable_generator(std::string const &, variable_scope const *);
 	input_status next(std::string &);
 };
 
 variable_generator::variable_generator(std::string const &n,
-	variable_map const *local_variables): name(n)
+	variable_scope const *local_variables): name(n)
 {
-	if (local_variables)
-	{
-		variable_map::const_iterator i = local_variables->find(name);
-		if (i != local_variables->end())
-		{
-			vcur = i->second.begin();
-			vend = i->second.end();
-			return;
-		}
-	}
-	variable_map::const_iterator i = variables.find(name);
-	if (i == variables.end()) return;
-	vcur = i->second.begin();
-	vend = i->second.end();
+	string_list const *v = find_variable(local_variables, name);
+	if (!v) return;
+	vcur = v->begin();
+	vend = v->end();
 }
 
 input_status variable_generator::next(std::string &res)
@@ -1219,9 +1943,9 @@ struct input_generator
 {
 	std::istream &in;
 	generator *nested;
-	variable_map const *local_variables;
+	variable_scope const *local_variables;
 	bool earliest_exit, done;
-	input_generator(std::istream &i, variable_map const *lv, bool e = false)
+	input_generator(std::istream &i, variable_scope const *lv, bool e = false)
 		: in(i), nested(NULL), local_variables(lv), earliest_exit(e), done(false) {}
 	input_status next(std::string &);
 	~input_generator() { assert(!nested); }
@@ -1417,6 +2141,52 @@ static generator *get_function(input_generator const &in, std::string const &nam
  * @{
  */
 
+/**
+ * Set the dependencies of all the targets of @a dep to @a dep.
+ * Update #reverse_dependencies accordingly.
+ */
+static void assign_dependency(ref_ptr<dependency_t> const &dep)
+{
+	for (id_list::const_iterator i = dep->targets.begin(),
+	     i_end = dep->targets.end(); i != i_end; ++i)
+	{
+		ref_ptr<dependency_t> &d = dependencies[*i];
+		if (!d.empty())
+		{
+			for (id_list::const_iterator j = d->deps.begin(),
+			     j_end = d->deps.end(); j != j_end; ++j)
+			{
+				erase_sorted(reverse_dependencies[*j], *i);
+			}
+		}
+		d = dep;
+		for (id_list::const_iterator j = dep->deps.begin(),
+		     j_end = dep->deps.end(); j != j_end; ++j)
+		{
+			insert_sorted(reverse_dependencies[*j], *i);
+		}
+	}
+}
+
+/**
+ * Add the sorted prerequisites @a deps to the dependencies @a dep.
+ * Update #reverse_dependencies accordingly.
+ */
+static void add_prerequisites(dependency_t &dep, id_list const &deps)
+{
+	insert_sorted(dep.deps, deps);
+	for (id_list::const_iterator i = deps.begin(),
+	     i_end = deps.end(); i != i_end; ++i)
+	{
+		id_list &l = reverse_dependencies[*i];
+		for (id_list::const_iterator j = dep.targets.begin(),
+		     j_end = dep.targets.end(); j != j_end; ++j)
+		{
+			insert_sorted(l, *j);
+		}
+	}
+}
+
 /**
  * Load dependencies from @a in.
  */
@@ -1438,63 +2208,689 @@ static void load_dependencies(std::istream &in)
 		DEBUG << "reading dependencies of target " << targets.front() << std::endl;
 		if (in.get() != ':') goto error;
 		ref_ptr<dependency_t> dep;
-		dep->targets = targets;
+		intern_list(targets, dep->targets);
 		string_list deps;
 		if (!read_words(in, deps)) goto error;
-		dep->deps.insert(deps.begin(), deps.end());
-		for (string_list::const_iterator i = targets.begin(),
-		     i_end = targets.end(); i != i_end; ++i)
-		{
-			dependencies[*i] = dep;
-		}
+		insert_sorted(dep->deps, deps);
+		assign_dependency(dep);
 		skip_empty(in);
 	}
 }
 
 /**
- * Load known dependencies from file <tt>.remake</tt>.
+ * Read-only view of the whole content of a file. The file is memory-mapped
+ * when the platform supports it, and read into a buffer otherwise.
  */
-static void load_dependencies()
+struct mapped_file
 {
-	DEBUG_open << "Loading database... ";
-	std::ifstream in(".remake");
-	if (!in.good())
-	{
-		DEBUG_close << "not found\n";
-		return;
-	}
-	load_dependencies(in);
-}
-
+	char const *data;
+	size_t size;
+#ifdef WINDOWS
+	std::vector<char> buf;
+#endif
+	mapped_file(): data(NULL), size(0) {}
+	~mapped_file();
+	bool open(char const *name);
+private:
+	mapped_file(mapped_file const &);
+	mapped_file &operator=(mapped_file const &);
+};
 
 /**
- * Save all the dependencies in file <tt>.remake</tt>.
+ * Map file @a name.
+ * @return false if the file could not be opened.
  */
-static void save_dependencies()
+bool mapped_file::open(char const *name)
 {
-	DEBUG_open << "Saving database... ";
-	std::ofstream db(".remake");
-	while (!dependencies.empty())
+#ifdef WINDOWS
+	std::ifstream in(name, std::ios::binary);
+	if (!in.good()) return false;
+	buf.assign(std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>());
+	size = buf.size();
+	if (size) data = &buf[0];
+	return true;
+#else
+	int fd = ::open(name, O_RDONLY);
+	if (fd < 0) return false;
+	struct stat s;
+	if (fstat(fd, &s) != 0)
 	{
-		ref_ptr<dependency_t> dep = dependencies.begin()->second;
-		for (string_list::const_iterator i = dep->targets.begin(),
-		     i_end = dep->targets.end(); i != i_end; ++i)
-		{
-			db << escape_string(*i) << ' ';
-			dependencies.erase(*i);
-		}
-		db << ':';
-		for (string_set::const_iterator i = dep->deps.begin(),
-		     i_end = dep->deps.end(); i != i_end; ++i)
+		close(fd);
+		return false;
+	}
+	size = s.st_size;
+	if (size)
+	{
+		void *p = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (p == MAP_FAILED)
 		{
-			db << ' ' << escape_string(*i);
+			close(fd);
+			return false;
 		}
-		db << std::endl;
+		data = (char const *)p;
 	}
+	close(fd);
+	return true;
+#endif
 }
 
-/** @} */
-
+mapped_file::~mapped_file()
+{
+#ifndef WINDOWS
+	if (data) munmap((void *)data, size);
+#endif
+}
+
+/**
+ * Magic string at the start of a binary database.
+ */
+static char const db_magic[8] = { 'R', 'E', 'M', 'A', 'K', 'E', 'D', 'B' };
+
+/**
+ * Version of the binary database format produced by #save_dependencies.
+ *
+ * All the integers are 32-bit little-endian words. After #db_magic come
+ * the version, the number @a S of strings, the number @a R of records,
+ * and the size of the string data in bytes. Then follow @a S+1 offsets
+ * into the string data, @a R+1 offsets (in words) into the record data,
+ * the string data padded to a multiple of 4, and the record data. Each
+ * record is the number of targets, the number of prerequisites, and the
+ * string indices of the targets then of the prerequisites.
+ *
+ * Since version 2, the records are followed by #reverse_dependencies: the
+ * number of entries, then for each entry, the string index of a target,
+ * the number of targets depending on it, and their string indices.
+ * Version 1 is still accepted; the reverse edges are then recomputed.
+ *
+ * Since version 3, they are followed by #file_hashes: the number of
+ * entries, then for each entry, the string index of a file and the five
+ * fields of #file_hash_t as pairs of words, low word first.
+ *
+ * Since version 4, they are followed by #durations: the number of entries,
+ * then for each entry, the string index of a target and its duration.
+ */
+enum { db_version = 4 };
+
+/**
+ * Append the 32-bit little-endian encoding of @a v to @a out.
+ */
+static void put_word(std::string &out, size_t v)
+{
+	char b[4] = { char(v), char(v >> 8), char(v >> 16), char(v >> 24) };
+	out.append(b, 4);
+}
+
+/**
+ * Append the 64-bit value @a v to @a out as two words, low word first.
+ */
+static void put_word64(std::string &out, uint64_t v)
+{
+	put_word(out, v & 0xffffffffu);
+	put_word(out, v >> 32);
+}
+
+/**
+ * Append @a s to @a out, prefixed by its length.
+ */
+static void put_string(std::string &out, std::string const &s)
+{
+	put_word(out, s.size());
+	out.append(s);
+}
+
+/**
+ * Sequential reader of 32-bit little-endian words and of length-prefixed
+ * strings. Reading past the end clears #ok and returns zero.
+ */
+struct word_reader
+{
+	unsigned char const *cur, *end;
+	bool ok;
+	word_reader(char const *b, char const *e)
+		: cur((unsigned char const *)b), end((unsigned char const *)e), ok(b <= e) {}
+	size_t get()
+	{
+		if (end - cur < 4)
+		{
+			ok = false;
+			return 0;
+		}
+		size_t v = cur[0] | cur[1] << 8 | cur[2] << 16 | (size_t)cur[3] << 24;
+		cur += 4;
+		return v;
+	}
+	uint64_t get64()
+	{
+		uint64_t v = get();
+		return v | (uint64_t)get() << 32;
+	}
+	void get(std::string &s)
+	{
+		size_t l = get();
+		if ((size_t)(end - cur) < l)
+		{
+			ok = false;
+			return;
+		}
+		s.assign((char const *)cur, l);
+		cur += l;
+	}
+};
+
+/**
+ * Read the fields of @a h from @a in.
+ */
+static void get_file_hash(word_reader &in, file_hash_t &h)
+{
+	h.size = in.get64();
+	h.mtime = in.get64();
+	h.ino = in.get64();
+	h.hash = in.get64();
+	h.inputs = in.get64();
+}
+
+/**
+ * Load dependencies from the binary database stored in @a data.
+ * @return false if the database is ill-formed.
+ */
+static bool load_dependencies(char const *data, size_t size)
+{
+	char const *end = data + size;
+	word_reader hdr(data + sizeof(db_magic), end);
+	size_t version = hdr.get();
+	if (version == 0 || version > db_version) return false;
+	size_t nb_strings = hdr.get(), nb_records = hdr.get(),
+		data_size = hdr.get();
+	if (!hdr.ok) return false;
+	size_t len = (char const *)hdr.cur - data;
+	if ((size - len) / 4 < nb_strings + nb_records + 2) return false;
+	word_reader str_offsets(data + len, end);
+	len += (nb_strings + 1) * 4;
+	word_reader rec_offsets(data + len, end);
+	len += (nb_records + 1) * 4;
+	if (size - len < data_size) return false;
+	char const *strings = data + len;
+	len += (data_size + 3) & ~(size_t)3;
+	if (len > size) return false;
+	char const *records = data + len;
+	size_t nb_words = (size - len) / 4;
+
+	id_list ids(nb_strings);
+	size_t prev = str_offsets.get();
+	for (size_t i = 0; i < nb_strings; ++i)
+	{
+		size_t next = str_offsets.get();
+		if (next < prev || next > data_size) return false;
+		ids[i] = intern(std::string(strings + prev, next - prev));
+		prev = next;
+	}
+
+	prev = rec_offsets.get();
+	for (size_t i = 0; i < nb_records; ++i)
+	{
+		size_t next = rec_offsets.get();
+		if (next < prev || next > nb_words) return false;
+		word_reader rec(records + prev * 4, records + next * 4);
+		prev = next;
+		size_t nb_targets = rec.get(), nb_deps = rec.get();
+		if (!rec.ok || nb_targets == 0 ||
+		    (size_t)(rec.end - rec.cur) / 4 != nb_targets + nb_deps)
+			return false;
+		ref_ptr<dependency_t> dep;
+		for (size_t j = 0; j < nb_targets; ++j)
+		{
+			size_t k = rec.get();
+			if (k >= nb_strings) return false;
+			dep->targets.push_back(ids[k]);
+		}
+		for (size_t j = 0; j < nb_deps; ++j)
+		{
+			size_t k = rec.get();
+			if (k >= nb_strings) return false;
+			dep->deps.push_back(ids[k]);
+		}
+		std::sort(dep->deps.begin(), dep->deps.end());
+		if (version == 1)
+		{
+			assign_dependency(dep);
+			continue;
+		}
+		// Reverse edges are loaded afterwards.
+		for (id_list::const_iterator j = dep->targets.begin(),
+		     j_end = dep->targets.end(); j != j_end; ++j)
+		{
+			dependencies[*j] = dep;
+		}
+	}
+	if (version == 1) return true;
+
+	word_reader rev(records + prev * 4, end);
+	size_t nb_entries = rev.get();
+	for (size_t i = 0; rev.ok && i < nb_entries; ++i)
+	{
+		size_t k = rev.get(), nb = rev.get();
+		if (k >= nb_strings || (size_t)(rev.end - rev.cur) / 4 < nb) return false;
+		id_list &l = reverse_dependencies[ids[k]];
+		for (size_t j = 0; j < nb; ++j)
+		{
+			size_t d = rev.get();
+			if (d >= nb_strings) return false;
+			l.push_back(ids[d]);
+		}
+		std::sort(l.begin(), l.end());
+	}
+	if (version == 2) return rev.ok;
+
+	size_t nb_hashes = rev.get();
+	for (size_t i = 0; rev.ok && i < nb_hashes; ++i)
+	{
+		size_t k = rev.get();
+		if (k >= nb_strings) return false;
+		get_file_hash(rev, file_hashes[ids[k]]);
+	}
+	if (version == 3) return rev.ok;
+
+	size_t nb_durations = rev.get();
+	for (size_t i = 0; rev.ok && i < nb_durations; ++i)
+	{
+		size_t k = rev.get();
+		if (k >= nb_strings) return false;
+		durations[ids[k]] = rev.get();
+	}
+	return rev.ok;
+}
+
+static void save_dependencies();
+
+/**
+ * Magic string at the start of the journal.
+ */
+static char const journal_magic[8] = { 'R', 'E', 'M', 'A', 'K', 'E', 'J', 'L' };
+
+/**
+ * Version of the journal format.
+ */
+enum { journal_version = 3 };
+
+/**
+ * Replay the journal stored in @a data on top of the loaded dependencies.
+ *
+ * After #journal_magic and #journal_version, the journal is a sequence of
+ * records, each of them prefixed by its size in bytes. A record is the
+ * number of targets, the number of prerequisites, and the targets then the
+ * prerequisites as length-prefixed strings. It replaces the dependencies
+ * of all its targets.
+ *
+ * Since version 2, a record with no targets is instead an entry of
+ * #file_hashes: the name of the file as a length-prefixed string, then the
+ * fields of #file_hash_t, as in the database. Since version 3, the name is
+ * preceded by a kind: 0 for such an entry, 1 for an entry of #durations,
+ * whose name is followed by the duration.
+ *
+ * @return the size of the well-formed prefix of the journal, or -1 if
+ *         the header is wrong. A shorter size denotes a header or a record
+ *         that was partially written when remake was interrupted.
+ */
+static size_t replay_journal(char const *data, size_t size)
+{
+	if (size && memcmp(data, journal_magic, std::min(size, sizeof(journal_magic))))
+		return -1;
+	if (size < sizeof(journal_magic) + 4) return 0;
+	char const *end = data + size;
+	word_reader hdr(data + sizeof(journal_magic), end);
+	size_t version = hdr.get();
+	if (version == 0 || version > journal_version) return -1;
+	// Journals from older versions are not appended to.
+	if (version != journal_version) database_obsolete = true;
+	char const *cur = (char const *)hdr.cur;
+	while (cur != end)
+	{
+		word_reader len(cur, end);
+		size_t l = len.get();
+		if (!len.ok || (size_t)(end - (char const *)len.cur) < l) break;
+		word_reader rec((char const *)len.cur, (char const *)len.cur + l);
+		size_t nb_targets = rec.get();
+		if (nb_targets == 0)
+		{
+			size_t kind = version >= 3 ? rec.get() : 0, duration = 0;
+			std::string name;
+			rec.get(name);
+			file_hash_t h;
+			if (kind == 0) get_file_hash(rec, h);
+			else duration = rec.get();
+			if (version == 1 || kind > 1 || !rec.ok || rec.cur != rec.end) break;
+			target_id t = intern(name);
+			if (kind == 0) file_hashes[t] = h;
+			else durations[t] = duration;
+			cur = (char const *)rec.end;
+			continue;
+		}
+		size_t nb_deps = rec.get();
+		string_list targets, deps;
+		for (size_t i = 0; rec.ok && i < nb_targets; ++i)
+		{
+			targets.push_back(std::string());
+			rec.get(targets.back());
+		}
+		for (size_t i = 0; rec.ok && i < nb_deps; ++i)
+		{
+			deps.push_back(std::string());
+			rec.get(deps.back());
+		}
+		if (!rec.ok || rec.cur != rec.end) break;
+		DEBUG << "replaying dependencies of target " << targets.front() << std::endl;
+		ref_ptr<dependency_t> dep;
+		intern_list(targets, dep->targets);
+		insert_sorted(dep->deps, deps);
+		assign_dependency(dep);
+		cur = (char const *)rec.end;
+	}
+	return cur - data;
+}
+
+/**
+ * Load known dependencies from file <tt>.remake</tt>, then apply the
+ * changes recorded in file <tt>.remake.journal</tt>.
+ * Databases in the older textual format are still accepted; they are
+ * converted to the binary format when saved.
+ */
+static void load_dependencies()
+{
+	trace_scope trace("load_dependencies");
+	DEBUG_open << "Loading database... ";
+	if (false)
+	{
+		error:
+		std::cerr << "Failed to load database" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	mapped_file db;
+	if (!db.open(".remake"))
+	{
+		DEBUG << "not found\n";
+	}
+	else if (db.size >= sizeof(db_magic) &&
+	         !memcmp(db.data, db_magic, sizeof(db_magic)))
+	{
+		if (!load_dependencies(db.data, db.size)) goto error;
+		database_size = db.size;
+	}
+	else
+	{
+		DEBUG << "converting from textual format\n";
+		memory_stream in(db.data, db.data + db.size);
+		load_dependencies(in);
+		database_obsolete = true;
+	}
+	mapped_file journal;
+	if (!journal.open(".remake.journal")) return;
+	size_t valid = replay_journal(journal.data, journal.size);
+	if (valid == (size_t)-1) goto error;
+	journal_size = valid;
+	if (journal_size == journal.size) return;
+	// Get rid of the partial header or record, so that new records can be
+	// appended.
+	DEBUG << "discarding a truncated journal\n";
+	database_obsolete = true;
+	save_dependencies();
+}
+
+/**
+ * Append @a recs to the journal.
+ * Errors are not fatal, since the database is then fully rewritten on exit.
+ */
+static void write_journal(std::string const &recs)
+{
+	if (database_obsolete) return;
+	if (journal_fd < 0)
+	{
+		journal_fd = open(".remake.journal", O_WRONLY | O_APPEND | O_CREAT | O_BINARY, 0666);
+		if (journal_fd < 0) goto error;
+#ifndef WINDOWS
+		fcntl(journal_fd, F_SETFD, FD_CLOEXEC);
+#endif
+		if (journal_size == 0)
+		{
+			std::string header(journal_magic, sizeof(journal_magic));
+			put_word(header, journal_version);
+			if (write(journal_fd, header.data(), header.size()) != (ssize_t)header.size())
+				goto error;
+			journal_size = header.size();
+		}
+	}
+	if (write(journal_fd, recs.data(), recs.size()) != (ssize_t)recs.size())
+		goto error;
+	journal_size += recs.size();
+	return;
+
+	error:
+	std::cerr << "Failed to write database journal" << std::endl;
+	database_obsolete = true;
+}
+
+/**
+ * Replace the first word of @a rec by the size of the rest of the record.
+ */
+static void seal_record(std::string &rec)
+{
+	std::string len;
+	put_word(len, rec.size() - 4);
+	rec.replace(0, 4, len);
+}
+
+/**
+ * Append the current dependencies of the targets of @a dep to the journal.
+ */
+static void journal_dependency(dependency_t const &dep)
+{
+	if (database_obsolete) return;
+	std::string rec;
+	put_word(rec, 0);
+	put_word(rec, dep.targets.size());
+	put_word(rec, dep.deps.size());
+	for (id_list::const_iterator i = dep.targets.begin(),
+	     i_end = dep.targets.end(); i != i_end; ++i)
+	{
+		put_string(rec, target_names[*i]);
+	}
+	for (id_list::const_iterator i = dep.deps.begin(),
+	     i_end = dep.deps.end(); i != i_end; ++i)
+	{
+		put_string(rec, target_names[*i]);
+	}
+	seal_record(rec);
+	write_journal(rec);
+}
+
+/**
+ * Append the fields of @a h to @a out.
+ */
+static void put_file_hash(std::string &out, file_hash_t const &h)
+{
+	put_word64(out, h.size);
+	put_word64(out, h.mtime);
+	put_word64(out, h.ino);
+	put_word64(out, h.hash);
+	put_word64(out, h.inputs);
+}
+
+/**
+ * Queue the entry of #file_hashes for @a t into #pending_records.
+ */
+static void journal_hash(target_id t)
+{
+	if (database_obsolete) return;
+	std::string rec;
+	put_word(rec, 0);
+	put_word(rec, 0);
+	put_word(rec, 0);
+	put_string(rec, target_names[t]);
+	put_file_hash(rec, file_hashes[t]);
+	seal_record(rec);
+	pending_records += rec;
+}
+
+/**
+ * Queue the entry of #durations for @a t into #pending_records.
+ */
+static void journal_duration(target_id t)
+{
+	if (database_obsolete) return;
+	std::string rec;
+	put_word(rec, 0);
+	put_word(rec, 0);
+	put_word(rec, 1);
+	put_string(rec, target_names[t]);
+	put_word(rec, durations[t]);
+	seal_record(rec);
+	pending_records += rec;
+}
+
+/**
+ * String table of a binary database being built.
+ */
+struct db_string_table
+{
+	std::vector<size_t> index;
+	size_t size;
+	std::string data, offsets;
+	db_string_table(): index(target_names.size(), -1), size(0)
+	{ put_word(offsets, 0); }
+	size_t operator()(target_id);
+};
+
+/**
+ * Return the index of the name of @a t in the table, adding it if needed.
+ */
+size_t db_string_table::operator()(target_id t)
+{
+	size_t &i = index[t];
+	if (i != (size_t)-1) return i;
+	data.append(target_names[t]);
+	put_word(offsets, data.size());
+	i = size++;
+	return i;
+}
+
+/**
+ * Save all the dependencies in file <tt>.remake</tt>, if the journal has
+ * grown too large with respect to it, and remove the journal.
+ * The database is first written to a temporary file, so that it is never
+ * left in an inconsistent state.
+ */
+static void save_dependencies()
+{
+	trace_scope trace("save_dependencies");
+	DEBUG_open << "Saving database... ";
+	if (!pending_records.empty())
+	{
+		write_journal(pending_records);
+		pending_records.clear();
+	}
+	if (journal_fd >= 0)
+	{
+		close(journal_fd);
+		journal_fd = -1;
+	}
+	if (!database_obsolete && journal_size <= database_size / 2 + 65536)
+	{
+		DEBUG_close << "changes kept in journal\n";
+		return;
+	}
+	db_string_table strings;
+	std::string records, rec_offsets;
+	put_word(rec_offsets, 0);
+	size_t nb_records = 0;
+	std::set<dependency_t const *> done;
+	for (dependency_map::const_iterator i = dependencies.begin(),
+	     i_end = dependencies.end(); i != i_end; ++i)
+	{
+		if (i->empty()) continue;
+		dependency_t const &dep = **i;
+		if (!done.insert(&dep).second) continue;
+		put_word(records, dep.targets.size());
+		put_word(records, dep.deps.size());
+		for (id_list::const_iterator j = dep.targets.begin(),
+		     j_end = dep.targets.end(); j != j_end; ++j)
+		{
+			put_word(records, strings(*j));
+		}
+		for (id_list::const_iterator j = dep.deps.begin(),
+		     j_end = dep.deps.end(); j != j_end; ++j)
+		{
+			put_word(records, strings(*j));
+		}
+		put_word(rec_offsets, records.size() / 4);
+		++nb_records;
+	}
+	std::string reverse;
+	size_t nb_entries = 0;
+	for (size_t i = 0, i_end = reverse_dependencies.size(); i != i_end; ++i)
+	{
+		id_list const &l = reverse_dependencies[i];
+		if (l.empty()) continue;
+		put_word(reverse, strings(i));
+		put_word(reverse, l.size());
+		for (id_list::const_iterator j = l.begin(), j_end = l.end(); j != j_end; ++j)
+		{
+			put_word(reverse, strings(*j));
+		}
+		++nb_entries;
+	}
+	put_word(records, nb_entries);
+	records += reverse;
+	std::string hashes;
+	nb_entries = 0;
+	for (size_t i = 0, i_end = file_hashes.size(); i != i_end; ++i)
+	{
+		file_hash_t const &h = file_hashes[i];
+		if (!h.hash) continue;
+		put_word(hashes, strings(i));
+		put_file_hash(hashes, h);
+		++nb_entries;
+	}
+	put_word(records, nb_entries);
+	records += hashes;
+	std::string times;
+	nb_entries = 0;
+	for (size_t i = 0, i_end = durations.size(); i != i_end; ++i)
+	{
+		if (!durations[i]) continue;
+		put_word(times, strings(i));
+		put_word(times, durations[i]);
+		++nb_entries;
+	}
+	put_word(records, nb_entries);
+	records += times;
+	std::string header(db_magic, sizeof(db_magic));
+	put_word(header, db_version);
+	put_word(header, strings.size);
+	put_word(header, nb_records);
+	put_word(header, strings.data.size());
+	strings.data.resize((strings.data.size() + 3) & ~(size_t)3);
+	{
+		std::ofstream db(".remake.tmp", std::ios::binary);
+		db << header << strings.offsets << rec_offsets << strings.data << records;
+		if (!db.good()) goto error;
+	}
+#ifdef WINDOWS
+	remove(".remake");
+#endif
+	if (rename(".remake.tmp", ".remake")) goto error;
+	remove(".remake.journal");
+	database_size = header.size() + strings.offsets.size() + rec_offsets.size() +
+		strings.data.size() + records.size();
+	database_obsolete = false;
+	journal_size = 0;
+	return;
+
+	error:
+	DEBUG_close << "failed\n";
+	std::cerr << "Failed to save database" << std::endl;
+}
+
+/** @} */
+
 static void merge_rule(rule_t &dest, rule_t const &src);
 
 /**
@@ -1517,10 +2913,8 @@ static void register_transparent_rule(rule_t const &rule, string_list const &tar
 	for (string_list::const_iterator i = targets.begin(),
 	     i_end = targets.end(); i != i_end; ++i)
 	{
-		std::pair<rule_map::iterator, bool> j =
-			specific_rules.insert(std::make_pair(*i, ref_ptr<rule_t>()));
-		ref_ptr<rule_t> &r = j.first->second;
-		if (j.second)
+		ref_ptr<rule_t> &r = specific_rules[intern(*i)];
+		if (r.empty())
 		{
 			r = ref_ptr<rule_t>(rule);
 			r->targets = string_list(1, *i);
@@ -1536,12 +2930,15 @@ static void register_transparent_rule(rule_t const &rule, string_list const &tar
 		merge_rule(*r, rule);
 	}
 
+	id_list deps;
+	insert_sorted(deps, rule.deps);
 	for (string_list::const_iterator i = targets.begin(),
 	     i_end = targets.end(); i != i_end; ++i)
 	{
-		ref_ptr<dependency_t> &dep = dependencies[*i];
-		if (dep->targets.empty()) dep->targets.push_back(*i);
-		dep->deps.insert(rule.deps.begin(), rule.deps.end());
+		target_id t = intern(*i);
+		dependency_t &dep = *dependencies[t];
+		if (dep.targets.empty()) dep.targets.push_back(t);
+		add_prerequisites(dep, deps);
 	}
 }
 
@@ -1557,59 +2954,157 @@ static void register_transparent_rule(rule_t const &rule, string_list const &tar
 static void register_scripted_rule(rule_t const &rule)
 {
 	ref_ptr<rule_t> r(rule);
-	for (string_list::const_iterator i = rule.targets.begin(),
-	     i_end = rule.targets.end(); i != i_end; ++i)
+	ref_ptr<dependency_t> dep;
+	intern_list(rule.targets, dep->targets);
+	insert_sorted(dep->deps, rule.deps);
+	for (id_list::const_iterator i = dep->targets.begin(),
+	     i_end = dep->targets.end(); i != i_end; ++i)
 	{
-		std::pair<rule_map::iterator, bool> j =
-			specific_rules.insert(std::make_pair(*i, r));
-		if (j.second) continue;
-		std::cerr << "Failed to load rules: " << *i
+		ref_ptr<rule_t> &s = specific_rules[*i];
+		if (s.empty())
+		{
+			s = r;
+			continue;
+		}
+		std::cerr << "Failed to load rules: " << target_names[*i]
 			<< " cannot be the target of several rules" << std::endl;
 		exit(EXIT_FAILURE);
 	}
 
-	ref_ptr<dependency_t> dep;
-	dep->targets = rule.targets;
-	dep->deps.insert(rule.deps.begin(), rule.deps.end());
-	for (string_list::const_iterator i = rule.targets.begin(),
-	     i_end = rule.targets.end(); i != i_end; ++i)
+	for (id_list::const_iterator i = dep->targets.begin(),
+	     i_end = dep->targets.end(); i != i_end; ++i)
 	{
-		ref_ptr<dependency_t> &d = dependencies[*i];
-		dep->deps.insert(d->deps.begin(), d->deps.end());
-		d = dep;
+		ref_ptr<dependency_t> const &d = dependencies[*i];
+		if (!d.empty()) insert_sorted(dep->deps, d->deps);
 	}
+	assign_dependency(dep);
 }
 
 /**
- * Read a rule starting with target @a first, if nonempty.
- * Store into #generic_rules or #specific_rules depending on its genericity.
+ * Append @a l to @a out, prefixed by its size.
  */
-static void load_rule(std::istream &in, std::string const &first)
+static void put_list(std::string &out, string_list const &l)
 {
-	DEBUG_open << "Reading rule for target " << first << "... ";
-	if (false)
+	put_word(out, l.size());
+	for (string_list::const_iterator i = l.begin(),
+	     i_end = l.end(); i != i_end; ++i)
 	{
-		error:
-		DEBUG_close << "failed\n";
-		std::cerr << "Failed to load rules: syntax error" << std::endl;
-		exit(EXIT_FAILURE);
+		put_string(out, *i);
 	}
-	rule_t rule;
+}
 
-	// Read targets and check genericity.
-	string_list targets;
-	if (!read_words(in, targets)) goto error;
-	if (!first.empty()) targets.push_front(first);
-	else if (targets.empty()) goto error;
-	else DEBUG << "actual target: " << targets.front() << std::endl;
-	bool generic = false;
-	normalize_list(targets, "", "");
-	for (string_list::const_iterator i = targets.begin(),
-	     i_end = targets.end(); i != i_end; ++i)
+/**
+ * Rules read from Remakefile so far, encoded as in the rule cache.
+ */
+static std::string cached_rules;
+
+/**
+ * Number of rules in #cached_rules.
+ */
+static size_t nb_cached_rules;
+
+/**
+ * Append @a rule to #cached_rules.
+ */
+static void cache_rule(rule_t const &rule)
+{
+	put_list(cached_rules, rule.targets);
+	put_list(cached_rules, rule.deps);
+	put_list(cached_rules, rule.wdeps);
+	put_word(cached_rules, rule.assigns.size());
+	for (assign_map::const_iterator i = rule.assigns.begin(),
+	     i_end = rule.assigns.end(); i != i_end; ++i)
 	{
-		if (i->empty()) goto error;
-		if ((i->find('%') != std::string::npos) != generic)
-		{
+		put_string(cached_rules, i->first);
+		put_word(cached_rules, i->second.append);
+		put_list(cached_rules, i->second.value);
+	}
+	put_string(cached_rules, rule.script);
+	++nb_cached_rules;
+}
+
+static void add_rule(rule_t &rule);
+
+/**
+ * Read the script of a rule, that is, all the following lines starting
+ * with a space character or a tabulation, and the empty lines among them.
+ */
+static std::string read_script(std::istream &in)
+{
+	if (memory_buf *mem = memory_buf::of(in))
+	{
+		std::string res;
+		char const *b = mem->cur(), *e = mem->end(), *p = b;
+		while (p != e)
+		{
+			if (*p == '\t' || *p == ' ')
+			{
+				++p;
+				char const *q = (char const *)memchr(p, '\n', e - p);
+				if (!q) q = e;
+				res.append(p, q - p);
+				p = q;
+			}
+			else if (*p == '\r' || *p == '\n')
+				res += *p++;
+			else break;
+		}
+		mem->skip(p - b);
+		if (p == e) in.setstate(std::ios::eofbit | std::ios::failbit);
+		return res;
+	}
+	std::ostringstream buf;
+	while (true)
+	{
+		char c = in.get();
+		if (!in.good()) break;
+		if (c == '\t' || c == ' ')
+		{
+			in.get(*buf.rdbuf());
+			if (in.fail() && !in.eof()) in.clear();
+		}
+		else if (c == '\r' || c == '\n')
+			buf << c;
+		else
+		{
+			in.putback(c);
+			break;
+		}
+	}
+	return buf.str();
+}
+
+
+/**
+ * Read a rule starting with target @a first, if nonempty.
+ * Store into #generic_rules or #specific_rules depending on its genericity.
+ */
+static void load_rule(std::istream &in, std::string const &first)
+{
+	DEBUG_open << "Reading rule for target " << first << "... ";
+	if (false)
+	{
+		error:
+		DEBUG_close << "failed\n";
+		std::cerr << "Failed to load rules: syntax error" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	rule_t rule;
+
+	// Read targets and check genericity.
+	string_list targets;
+	if (!read_words(in, targets)) goto error;
+	if (!first.empty()) targets.push_front(first);
+	else if (targets.empty()) goto error;
+	else DEBUG << "actual target: " << targets.front() << std::endl;
+	bool generic = false;
+	normalize_list(targets, "", "");
+	for (string_list::const_iterator i = targets.begin(),
+	     i_end = targets.end(); i != i_end; ++i)
+	{
+		if (i->empty()) goto error;
+		if ((i->find('%') != std::string::npos) != generic)
+		{
 			if (i == targets.begin()) generic = true;
 			else goto error;
 		}
@@ -1654,26 +3149,81 @@ static void load_rule(std::istream &in, std::string const &first)
 	skip_spaces(in);
 	if (!skip_eol(in, true)) goto error;
 
-	// Read script.
-	std::ostringstream buf;
+	rule.script = read_script(in);
+
+	if (assignment && (generic || !rule.script.empty())) goto error;
+	cache_rule(rule);
+	add_rule(rule);
+}
+
+/**
+ * Compile @a script into @a res, so that the variables and automatic
+ * variables it contains can be substituted without parsing it again.
+ * A script with a syntax error is compiled as <tt>false</tt>.
+ */
+static void compile_script(std::string const &script, script_template &res)
+{
+	std::istringstream in(script);
+	size_t len = script.size(), pos = 0;
 	while (true)
 	{
-		char c = in.get();
-		if (!in.good()) break;
-		if (c == '\t' || c == ' ')
+		size_t p = script.find('$', pos);
+		if (p == std::string::npos || p == len - 1) p = len;
+		if (p != pos)
+			res.push_back(script_segment_t(script_segment_t::Literal, script.substr(pos, p - pos)));
+		if (p == len) break;
+		++p;
+		pos = p + 1;
+		switch (script[p])
 		{
-			in.get(*buf.rdbuf());
-			if (in.fail() && !in.eof()) in.clear();
-		}
-		else if (c == '\r' || c == '\n')
-			buf << c;
-		else
+		case '$':
+			res.push_back(script_segment_t(script_segment_t::Literal, "$"));
+			break;
+		case '<': res.push_back(script_segment_t::FirstDep); break;
+		case '^': res.push_back(script_segment_t::AllDeps); break;
+		case '@': res.push_back(script_segment_t::Target); break;
+		case '*': res.push_back(script_segment_t::Stem); break;
+		case '(':
 		{
-			in.putback(c);
+			// Go through the expression to find where it ends.
+			in.seekg(p - 1);
+			input_generator gen(in, NULL, true);
+			std::string w;
+			input_status st;
+			while ((st = gen.next(w)) == Success) {}
+			if (st == SyntaxError)
+			{
+				res.assign(1, script_segment_t(script_segment_t::Literal, "false"));
+				return;
+			}
+			pos = in.eof() ? len : (size_t)in.tellg();
+			std::string e = script.substr(p - 1, pos - (p - 1));
+			bool simple = true;
+			for (size_t i = 2, i_end = e.size() - 1; simple && i != i_end; ++i)
+				simple = !is_separator((unsigned char)e[i]) && !strchr(" \"\\=+", e[i]);
+			if (simple && e.size() > 3 && e[e.size() - 1] == ')')
+				res.push_back(script_segment_t(script_segment_t::Variable, e.substr(2, e.size() - 3)));
+			else
+				res.push_back(script_segment_t(script_segment_t::Expression, e));
 			break;
 		}
+		default:
+			// Let dollars followed by an unrecognized character
+			// go through. This differs from Make, which would
+			// use a one-letter variable.
+			res.push_back(script_segment_t(script_segment_t::Literal, "$"));
+			pos = p;
+		}
 	}
-	rule.script = buf.str();
+}
+
+/**
+ * Register @a rule, once read: mark phony targets, or add it to
+ * #generic_rules or to #specific_rules depending on its genericity.
+ */
+static void add_rule(rule_t &rule)
+{
+	if (!rule.script.empty()) compile_script(rule.script, *rule.compiled);
 
 	// Register phony targets.
 	if (rule.targets.front() == ".PHONY")
@@ -1681,22 +3231,22 @@ static void load_rule(std::istream &in, std::string const &first)
 		for (string_list::const_iterator i = rule.deps.begin(),
 		     i_end = rule.deps.end(); i != i_end; ++i)
 		{
-			status[*i].status = Todo;
+			target_id t = intern(*i);
+			status[t].status = Todo;
+			phony_targets.push_back(t);
 		}
 		return;
 	}
 
 	// Add generic rules to the correct set.
-	if (generic)
+	if (rule.targets.front().find('%') != std::string::npos)
 	{
-		if (assignment) goto error;
-		generic_rules.push_back(rule);
+		generic_rules.push_back(ref_ptr<rule_t>(rule));
 		return;
 	}
 
 	if (!rule.script.empty())
 	{
-		if (assignment) goto error;
 		register_scripted_rule(rule);
 	}
 	else
@@ -1714,29 +3264,187 @@ static void load_rule(std::istream &in, std::string const &first)
 }
 
 /**
- * Load rules from @a remakefile.
- * If some rules have dependencies and non-generic targets, add these
- * dependencies to the targets.
+ * Index the target patterns of #generic_rules, so that #find_generic_rule
+ * does not have to scan all of them.
  */
-static void load_rules(std::string const &remakefile)
+static void index_generic_rules()
+{
+	generic_patterns.clear();
+	suffix_trie.assign(1, suffix_node_t());
+	generic_matches.clear();
+	for (int i = 0, i_end = generic_rules.size(); i != i_end; ++i)
+	{
+		string_list const &targets = generic_rules[i]->targets;
+		for (string_list::const_iterator j = targets.begin(),
+		     j_end = targets.end(); j != j_end; ++j)
+		{
+			size_t pos = j->find('%');
+			if (pos == std::string::npos) continue;
+			generic_pattern_t p = { i, &*j, pos, j->length() };
+			int node = 0;
+			for (size_t k = p.length; k > pos + 1; --k)
+			{
+				int size = suffix_trie.size();
+				std::pair<std::map<char, int>::iterator, bool> n =
+					suffix_trie[node].next.insert(std::make_pair((*j)[k - 1], size));
+				node = n.first->second;
+				if (n.second) suffix_trie.push_back(suffix_node_t());
+			}
+			suffix_trie[node].patterns.push_back(generic_patterns.size());
+			generic_patterns.push_back(p);
+		}
+	}
+}
+
+/**
+ * Magic string at the start of the rule cache.
+ */
+static char const rules_magic[8] = { 'R', 'E', 'M', 'A', 'K', 'E', 'R', 'C' };
+
+/**
+ * Version of the format of the rule cache, <tt>.remake.rules</tt>.
+ *
+ * All the integers are 32-bit little-endian words, and the strings are
+ * length-prefixed. After #rules_magic come the version and the key of the
+ * cache, as a pair of words. Then follow the variables, the options, and
+ * the rules in the order of the Remakefile. Lists are prefixed by their
+ * size. A variable is its name and its list of words. A rule is its lists
+ * of targets, prerequisites, and order-only prerequisites, its list of
+ * assignments, each of them being a name, an append flag, and a list of
+ * words, and finally its script.
+ */
+enum { rules_version = 1 };
+
+/**
+ * Read a list of strings, as written by #put_list, and append it to @a l.
+ */
+static void get_list(word_reader &in, string_list &l)
+{
+	for (size_t n = in.get(); in.ok && n > 0; --n)
+	{
+		l.push_back(std::string());
+		in.get(l.back());
+	}
+}
+
+static uint64_t hash_bytes(char const *data, size_t len, uint64_t seed);
+
+/**
+ * Compute the key of the rule cache for the content @a data of the rules,
+ * given the variables set on the command line.
+ */
+static uint64_t rules_key(mapped_file const &data)
+{
+	std::string vars;
+	for (variable_map::const_iterator i = variables.begin(),
+	     i_end = variables.end(); i != i_end; ++i)
+	{
+		put_string(vars, i->first);
+		put_list(vars, i->second);
+	}
+	uint64_t k = hash_bytes(vars.data(), vars.size(), rules_version);
+	return hash_bytes(data.data, data.size, k);
+}
+
+/**
+ * Load the rules and the variables from the rule cache, provided it was
+ * produced with key @a key.
+ * @return false if the cache is missing, stale, or damaged, in which case
+ *         nothing was loaded.
+ */
+static bool load_cached_rules(uint64_t key, string_list &options)
+{
+	mapped_file cache;
+	if (!cache.open(".remake.rules") || cache.size < sizeof(rules_magic) ||
+	    memcmp(cache.data, rules_magic, sizeof(rules_magic)))
+		return false;
+	word_reader in(cache.data + sizeof(rules_magic), cache.data + cache.size);
+	if (in.get() != rules_version || in.get64() != key || !in.ok) return false;
+	variable_map vars;
+	for (size_t n = in.get(); in.ok && n > 0; --n)
+	{
+		std::string name;
+		in.get(name);
+		get_list(in, vars[name]);
+	}
+	get_list(in, options);
+	rule_list rules;
+	for (size_t n = in.get(); in.ok && n > 0; --n)
+	{
+		rules.push_back(rule_t());
+		rule_t &r = rules.back();
+		get_list(in, r.targets);
+		get_list(in, r.deps);
+		get_list(in, r.wdeps);
+		for (size_t m = in.get(); in.ok && m > 0; --m)
+		{
+			std::string name;
+			in.get(name);
+			assign_t &a = r.assigns[name];
+			a.append = in.get();
+			get_list(in, a.value);
+		}
+		in.get(r.script);
+		if (r.targets.empty()) in.ok = false;
+	}
+	if (!in.ok || in.cur != in.end) return false;
+	variables.swap(vars);
+	for (rule_list::iterator i = rules.begin(),
+	     i_end = rules.end(); i != i_end; ++i)
+	{
+		add_rule(*i);
+	}
+	return true;
+}
+
+/**
+ * Store the rules and the variables loaded from Remakefile into the rule
+ * cache, with key @a key. Failures are not fatal.
+ */
+static void save_cached_rules(uint64_t key, string_list const &options)
+{
+	DEBUG_open << "Saving rule cache... ";
+	std::string out(rules_magic, sizeof(rules_magic));
+	put_word(out, rules_version);
+	put_word64(out, key);
+	put_word(out, variables.size());
+	for (variable_map::const_iterator i = variables.begin(),
+	     i_end = variables.end(); i != i_end; ++i)
+	{
+		put_string(out, i->first);
+		put_list(out, i->second);
+	}
+	put_list(out, options);
+	put_word(out, nb_cached_rules);
+	{
+		std::ofstream cache(".remake.rules.tmp", std::ios::binary);
+		cache << out << cached_rules;
+		if (!cache.good()) goto error;
+	}
+#ifdef WINDOWS
+	remove(".remake.rules");
+#endif
+	if (rename(".remake.rules.tmp", ".remake.rules")) goto error;
+	return;
+
+	error:
+	DEBUG_close << "failed\n";
+	remove(".remake.rules.tmp");
+}
+
+/**
+ * Read rules and variables from @a in. Store the options into @a options.
+ */
+static void parse_rules(std::istream &in, string_list &options)
 {
-	DEBUG_open << "Loading rules... ";
 	if (false)
 	{
 		error:
 		std::cerr << "Failed to load rules: syntax error" << std::endl;
 		exit(EXIT_FAILURE);
 	}
-	std::ifstream in(remakefile.c_str());
-	if (!in.good())
-	{
-		std::cerr << "Failed to load rules: no Remakefile found" << std::endl;
-		exit(EXIT_FAILURE);
-	}
 	skip_empty(in);
 
-	string_list options;
-
 	// Read rules
 	while (in.good())
 	{
@@ -1767,18 +3475,68 @@ static void load_rules(std::string const &remakefile)
 		}
 		else load_rule(in, std::string());
 	}
+}
+
+/**
+ * Load rules from @a remakefile.
+ * If some rules have dependencies and non-generic targets, add these
+ * dependencies to the targets.
+ *
+ * The rules are taken from the rule cache if neither @a remakefile nor the
+ * variables set on the command line have changed since it was saved.
+ */
+static void load_rules(std::string const &remakefile)
+{
+	trace_scope trace("load_rules");
+	DEBUG_open << "Loading rules... ";
+	mapped_file content;
+	// Files that cannot be mapped, e.g. pipes, are read as streams and
+	// are not cached.
+	uint64_t key = content.open(remakefile.c_str()) && content.size ?
+		rules_key(content) : 0;
+	string_list options;
+	if (key && load_cached_rules(key, options))
+	{
+		DEBUG << "cached\n";
+	}
+	else
+	{
+		cached_rules.clear();
+		nb_cached_rules = 0;
+		if (key)
+		{
+			memory_stream in(content.data, content.data + content.size);
+			parse_rules(in, options);
+			save_cached_rules(key, options);
+		}
+		else
+		{
+			std::ifstream in(remakefile.c_str());
+			if (!in.good())
+			{
+				std::cerr << "Failed to load rules: no Remakefile found" << std::endl;
+				exit(EXIT_FAILURE);
+			}
+			parse_rules(in, options);
+		}
+		cached_rules.clear();
+	}
 
 	// Set actual options.
 	for (string_list::const_iterator i = options.begin(),
 	     i_end = options.end(); i != i_end; ++i)
 	{
 		if (*i == "variable-propagation") propagate_vars = true;
+		else if (*i == "checksum") checksums = true;
+		else if (*i == "cache") use_cache = true;
 		else
 		{
 			std::cerr << "Failed to load rules: unrecognized option" << std::endl;
 			exit(EXIT_FAILURE);
 		}
 	}
+
+	index_generic_rules();
 }
 
 /** @} */
@@ -1789,26 +3547,52 @@ static void load_rules(std::string const &remakefile)
  * @{
  */
 
-static void merge_rule(rule_t &dest, rule_t const &src)
+/**
+ * Add the assignments @a src to @a dest. Appending assignments extend the
+ * ones already in @a dest, while the other ones replace them.
+ */
+static void merge_assigns(assign_map &dest, assign_map const &src)
 {
-	dest.deps.insert(dest.deps.end(), src.deps.begin(), src.deps.end());
-	dest.wdeps.insert(dest.wdeps.end(), src.wdeps.begin(), src.wdeps.end());
-	for (assign_map::const_iterator i = src.assigns.begin(),
-	     i_end = src.assigns.end(); i != i_end; ++i)
+	for (assign_map::const_iterator i = src.begin(),
+	     i_end = src.end(); i != i_end; ++i)
 	{
 		if (!i->second.append)
 		{
 			new_assign:
-			dest.assigns[i->first] = i->second;
+			dest[i->first] = i->second;
 			continue;
 		}
-		assign_map::iterator j = dest.assigns.find(i->first);
-		if (j == dest.assigns.end()) goto new_assign;
+		assign_map::iterator j = dest.find(i->first);
+		if (j == dest.end()) goto new_assign;
 		j->second.value.insert(j->second.value.end(),
 			i->second.value.begin(), i->second.value.end());
 	}
 }
 
+/**
+ * Add the dependencies and assignments of the specific rule @a src to the
+ * rule @a dest, when loading rules without scripts for the same target.
+ */
+static void merge_rule(rule_t &dest, rule_t const &src)
+{
+	dest.deps.insert(dest.deps.end(), src.deps.begin(), src.deps.end());
+	dest.wdeps.insert(dest.wdeps.end(), src.wdeps.begin(), src.wdeps.end());
+	merge_assigns(dest.assigns, src.assigns);
+}
+
+/**
+ * Add the dependencies and assignments of the specific rule @a src to the
+ * ones of @a job, which has been instantiated from a generic rule. Unlike
+ * the overload for rules, it only extends the delta stored in the job,
+ * since the generic rule itself is shared.
+ */
+static void merge_rule(job_t &job, rule_t const &src)
+{
+	job.deps.insert(job.deps.end(), src.deps.begin(), src.deps.end());
+	job.wdeps.insert(job.wdeps.end(), src.wdeps.begin(), src.wdeps.end());
+	merge_assigns(job.assigns, src.assigns);
+}
+
 /**
  * Substitute a pattern into a list of strings.
  */
@@ -1824,38 +3608,70 @@ static void substitute_pattern(std::string const &pat, string_list const &src, s
 }
 
 /**
- * Find a generic rule matching @a target:
+ * Find the pattern of a generic rule matching @a target:
  * - the one leading to shorter matches has priority,
- * - among equivalent rules, the earliest one has priority.
+ * - among equivalent rules, the earliest one has priority,
+ * - within a rule, the first matching target is used.
+ * @return the index of the pattern in #generic_patterns, or -1.
  */
-static void find_generic_rule(job_t &job, std::string const &target)
+static int match_generic_rule(std::string const &target)
 {
-	size_t tlen = target.length(), plen = tlen + 1;
-	for (rule_list::const_iterator i = generic_rules.begin(),
-	     i_end = generic_rules.end(); i != i_end; ++i)
+	// Gather the patterns whose suffix matches, by walking the suffix trie
+	// from the end of the target, then check their prefix.
+	size_t tlen = target.length();
+	std::vector<int> matches;
+	for (size_t k = tlen, node = 0;; --k)
 	{
-		for (string_list::const_iterator j = i->targets.begin(),
-		     j_end = i->targets.end(); j != j_end; ++j)
+		std::vector<int> const &l = suffix_trie[node].patterns;
+		for (std::vector<int>::const_iterator i = l.begin(),
+		     i_end = l.end(); i != i_end; ++i)
 		{
-			size_t len = j->length();
-			if (tlen < len) continue;
-			if (plen <= tlen - (len - 1)) continue;
-			size_t pos = j->find('%');
-			if (pos == std::string::npos) continue;
-			size_t len2 = len - (pos + 1);
-			if (j->compare(0, pos, target, 0, pos) ||
-			    j->compare(pos + 1, len2, target, tlen - len2, len2))
-				continue;
-			plen = tlen - (len - 1);
-			job.stem = target.substr(pos, plen);
-			job.rule = rule_t();
-			job.rule.script = i->script;
-			substitute_pattern(job.stem, i->targets, job.rule.targets);
-			substitute_pattern(job.stem, i->deps, job.rule.deps);
-			substitute_pattern(job.stem, i->wdeps, job.rule.wdeps);
-			break;
+			generic_pattern_t const &p = generic_patterns[*i];
+			if (tlen < p.length) continue;
+			if (p.prefix && target.compare(0, p.prefix, *p.pattern, 0, p.prefix)) continue;
+			matches.push_back(*i);
 		}
+		if (k == 0) break;
+		std::map<char, int>::const_iterator n = suffix_trie[node].next.find(target[k - 1]);
+		if (n == suffix_trie[node].next.end()) break;
+		node = n->second;
 	}
+
+	// Pick the pattern as if all of them were scanned in order.
+	std::sort(matches.begin(), matches.end());
+	int res = -1;
+	size_t plen = tlen + 1;
+	int done = -1;
+	for (std::vector<int>::const_iterator i = matches.begin(),
+	     i_end = matches.end(); i != i_end; ++i)
+	{
+		generic_pattern_t const &p = generic_patterns[*i];
+		if (p.rule == done || plen <= tlen - (p.length - 1)) continue;
+		plen = tlen - (p.length - 1);
+		res = *i;
+		done = p.rule;
+	}
+	return res;
+}
+
+/**
+ * Find a generic rule matching @a target and instantiate it into @a job.
+ * The choice of the rule is memoized.
+ */
+static void find_generic_rule(job_t &job, target_id target)
+{
+	if (generic_matches.size() <= (size_t)target)
+		generic_matches.resize(target_names.size(), -2);
+	int &m = generic_matches[target];
+	if (m == -2) m = match_generic_rule(target_names[target]);
+	if (m < 0) return;
+	generic_pattern_t const &p = generic_patterns[m];
+	job.rule = generic_rules[p.rule];
+	rule_t const &r = *job.rule;
+	job.stem = target_names[target].substr(p.prefix, target_names[target].length() - (p.length - 1));
+	substitute_pattern(job.stem, r.targets, job.targets);
+	substitute_pattern(job.stem, r.deps, job.deps);
+	substitute_pattern(job.stem, r.wdeps, job.wdeps);
 }
 
 /**
@@ -1863,42 +3679,39 @@ static void find_generic_rule(job_t &job, std::string const &target)
  * If there is both a specific rule with an empty script and a generic rule, the
  * generic one is returned after adding the dependencies of the specific one.
  */
-static void find_rule(job_t &job, std::string const &target)
+static void find_rule(job_t &job, target_id target)
 {
-	rule_map::const_iterator i = specific_rules.find(target),
-		i_end = specific_rules.end();
+	ref_ptr<rule_t> const &r = specific_rules[target];
 	// If there is a specific rule with a script, return it.
-	if (i != i_end && !i->second->script.empty())
+	if (!r.empty() && !r->script.empty())
 	{
-		job.rule = *i->second;
+		job.rule = r;
 		return;
 	}
 	find_generic_rule(job, target);
 	// If there is no generic rule, return the specific rule (no script), if any.
-	if (job.rule.targets.empty())
+	if (job.rule.empty())
 	{
-		if (i != i_end)
-		{
-			job.rule = *i->second;
-			return;
-		}
+		job.rule = r;
+		return;
 	}
 	// Optimize the lookup when there is only one target (already looked up).
-	if (job.rule.targets.size() == 1)
+	if (job.targets.size() == 1)
 	{
-		if (i == i_end) return;
-		merge_rule(job.rule, *i->second);
+		if (r.empty()) return;
+		merge_rule(job, *r);
 		return;
 	}
 	// Add the dependencies of the specific rules of every target to the
 	// generic rule. If any of those rules has a nonempty script, error out.
-	for (string_list::const_iterator j = job.rule.targets.begin(),
-	     j_end = job.rule.targets.end(); j != j_end; ++j)
+	for (string_list::const_iterator j = job.targets.begin(),
+	     j_end = job.targets.end(); j != j_end; ++j)
 	{
-		i = specific_rules.find(*j);
-		if (i == i_end) continue;
-		if (!i->second->script.empty()) return;
-		merge_rule(job.rule, *i->second);
+		target_id t = find_target(*j);
+		if (t < 0 || specific_rules[t].empty()) continue;
+		rule_t const &s = *specific_rules[t];
+		if (!s.script.empty()) return;
+		merge_rule(job, s);
 	}
 }
 
@@ -1911,36 +3724,383 @@ static void find_rule(job_t &job, std::string const &target)
  */
 
 /**
- * Compute and memoize the status of @a target:
- * - if the file does not exist, the target is obsolete,
- * - if any dependency is obsolete or younger than the file, it is obsolete,
- * - otherwise it is up-to-date.
- *
- * @note For rules with multiple targets, all the targets share the same
- *       status. (If one is obsolete, they all are.) The second rule above
- *       is modified in that case: the latest target is chosen, not the oldest!
+ * Get the modification date of the file described by @a s.
  */
-static status_t const &get_status(std::string const &target)
+static file_time get_file_time(struct stat const &s)
 {
-	std::pair<status_map::iterator,bool> i =
-		status.insert(std::make_pair(target, status_t()));
-	status_t &ts = i.first->second;
-	if (!i.second) return ts;
-	DEBUG_open << "Checking status of " << target << "... ";
-	dependency_map::const_iterator j = dependencies.find(target);
-	if (j == dependencies.end())
-	{
-		struct stat s;
-		if (stat(target.c_str(), &s) != 0)
-		{
-			DEBUG_close << "missing\n";
-			ts.status = Todo;
-			ts.last = 0;
-			return ts;
-		}
+#if defined(WINDOWS)
+	return (file_time)s.st_mtime * 1000000000;
+#elif defined(MACOSX)
+	return (file_time)s.st_mtimespec.tv_sec * 1000000000 + s.st_mtimespec.tv_nsec;
+#else
+	return (file_time)s.st_mtim.tv_sec * 1000000000 + s.st_mtim.tv_nsec;
+#endif
+}
+
+/**
+ * Get the current date, as it would be given to a file modified now.
+ */
+static file_time current_time()
+{
+#ifdef WINDOWS
+	return (file_time)time(NULL) * 1000000000;
+#else
+	struct timespec ts;
+#ifdef CLOCK_REALTIME_COARSE
+	// Linux dates files with the coarse clock, which can lag behind.
+	clock_gettime(CLOCK_REALTIME_COARSE, &ts);
+#else
+	clock_gettime(CLOCK_REALTIME, &ts);
+#endif
+	return (file_time)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+struct stat_result
+{
+	bool fetched, exists;
+	file_time mtime;
+	uint64_t size, ino;
+	stat_result(): fetched(false), exists(false), mtime(0), size(0), ino(0) {}
+};
+
+/**
+ * Results of #prefetch_status, indexed by target identifiers.
+ * They are valid until a script is started.
+ */
+static std::vector<stat_result> prefetched;
+
+#ifndef WINDOWS
+/**
+ * Targets shared by the threads of #prefetch_status.
+ */
+struct prefetch_queue
+{
+	id_list targets;
+	size_t next;
+	pthread_mutex_t lock;
+};
+
+/**
+ * Thread body for #prefetch_status: call stat on batches of targets from
+ * @a arg until there are none left.
+ */
+static void *prefetch_worker(void *arg)
+{
+	prefetch_queue &q = *(prefetch_queue *)arg;
+	size_t len = q.targets.size();
+	while (true)
+	{
+		pthread_mutex_lock(&q.lock);
+		size_t i = q.next, i_end = std::min(i + 64, len);
+		q.next = i_end;
+		pthread_mutex_unlock(&q.lock);
+		if (i == len) return NULL;
+		for (; i != i_end; ++i)
+		{
+			struct stat s;
+			target_id t = q.targets[i];
+			stat_result &r = prefetched[t];
+			r.exists = stat(target_names[t].c_str(), &s) == 0;
+			if (!r.exists) continue;
+			r.mtime = get_file_time(s);
+			r.size = s.st_size;
+			r.ino = s.st_ino;
+		}
+	}
+}
+#endif
+
+/**
+ * Call stat in parallel on all the files reachable from @a targets through
+ * #dependencies, so that #get_status does not have to wait on each of
+ * them in turn. This matters for network file systems and cold caches.
+ */
+static void prefetch_status(string_list const &targets)
+{
+#ifndef WINDOWS
+	DEBUG_open << "Prefetching status... ";
+	prefetch_queue q;
+	id_list todo;
+	intern_list(targets, todo);
+	std::vector<char> seen(target_names.size());
+	while (!todo.empty())
+	{
+		target_id t = todo.back();
+		todo.pop_back();
+		if (seen[t]) continue;
+		seen[t] = true;
+		if (dependencies[t].empty())
+		{
+			q.targets.push_back(t);
+			continue;
+		}
+		dependency_t const &dep = *dependencies[t];
+		q.targets.insert(q.targets.end(), dep.targets.begin(), dep.targets.end());
+		for (id_list::const_iterator j = dep.deps.begin(),
+		     j_end = dep.deps.end(); j != j_end; ++j)
+		{
+			if (!seen[*j]) todo.push_back(*j);
+		}
+	}
+
+	std::sort(q.targets.begin(), q.targets.end());
+	q.targets.erase(std::unique(q.targets.begin(), q.targets.end()), q.targets.end());
+	prefetched.assign(target_names.size(), stat_result());
+	for (id_list::const_iterator i = q.targets.begin(),
+	     i_end = q.targets.end(); i != i_end; ++i)
+	{
+		prefetched[*i].fetched = true;
+	}
+	q.next = 0;
+	pthread_mutex_init(&q.lock, NULL);
+	size_t nb_threads = std::min<size_t>(16, q.targets.size() / 256);
+	std::vector<pthread_t> threads(nb_threads);
+	size_t started = 0;
+	for (; started < nb_threads; ++started)
+	{
+		if (pthread_create(&threads[started], NULL, &prefetch_worker, &q))
+			break;
+	}
+	prefetch_worker(&q);
+	for (size_t i = 0; i < started; ++i)
+	{
+		pthread_join(threads[i], NULL);
+	}
+	pthread_mutex_destroy(&q.lock);
+	DEBUG_close << q.targets.size() << " files, " << started + 1 << " threads\n";
+#else
+	(void)targets;
+#endif
+}
+
+/**
+ * Get the stat information of @a target, from #prefetched if possible.
+ * @return false if the file does not exist.
+ */
+static bool get_stat(target_id target, stat_result &r)
+{
+	if ((size_t)target < prefetched.size() && prefetched[target].fetched)
+	{
+		r = prefetched[target];
+		return r.exists;
+	}
+	struct stat s;
+	r.exists = stat(target_names[target].c_str(), &s) == 0;
+	if (!r.exists) return false;
+	r.mtime = get_file_time(s);
+	r.size = s.st_size;
+	r.ino = s.st_ino;
+	return true;
+}
+
+/**
+ * Forget the prefetched stat information of @a target, since the file
+ * might have been written in the meantime.
+ */
+static void drop_prefetched(target_id target)
+{
+	if ((size_t)target < prefetched.size()) prefetched[target] = stat_result();
+}
+
+/**
+ * Get the modification time of @a target, from #prefetched if possible.
+ * @return false if the file does not exist.
+ */
+static bool get_mtime(target_id target, file_time &mtime)
+{
+	stat_result r;
+	if (!get_stat(target, r)) return false;
+	mtime = r.mtime;
+	return true;
+}
+
+static uint64_t const hash_prime1 = 11400714785074694791ULL;
+static uint64_t const hash_prime2 = 14029467366897019727ULL;
+static uint64_t const hash_prime3 = 1609587929392839161ULL;
+static uint64_t const hash_prime4 = 9650029242287828579ULL;
+static uint64_t const hash_prime5 = 2870177450012600261ULL;
+
+static uint64_t rotate_left(uint64_t v, int r)
+{
+	return (v << r) | (v >> (64 - r));
+}
+
+static uint64_t read64(unsigned char const *p)
+{
+	uint64_t v;
+	memcpy(&v, p, 8);
+	return v;
+}
+
+static uint64_t hash_round(uint64_t acc, uint64_t v)
+{
+	return rotate_left(acc + v * hash_prime2, 31) * hash_prime1;
+}
+
+static uint64_t hash_merge(uint64_t acc, uint64_t v)
+{
+	return (acc ^ hash_round(0, v)) * hash_prime1 + hash_prime4;
+}
+
+/**
+ * Hash the @a len bytes at @a data with the XXH64 function.
+ */
+static uint64_t hash_bytes(char const *data, size_t len, uint64_t seed)
+{
+	unsigned char const *p = (unsigned char const *)data, *end = p + len;
+	uint64_t h;
+	if (len >= 32)
+	{
+		uint64_t v1 = seed + hash_prime1 + hash_prime2, v2 = seed + hash_prime2,
+			v3 = seed, v4 = seed - hash_prime1;
+		for (; end - p >= 32; p += 32)
+		{
+			v1 = hash_round(v1, read64(p));
+			v2 = hash_round(v2, read64(p + 8));
+			v3 = hash_round(v3, read64(p + 16));
+			v4 = hash_round(v4, read64(p + 24));
+		}
+		h = rotate_left(v1, 1) + rotate_left(v2, 7) +
+			rotate_left(v3, 12) + rotate_left(v4, 18);
+		h = hash_merge(h, v1);
+		h = hash_merge(h, v2);
+		h = hash_merge(h, v3);
+		h = hash_merge(h, v4);
+	}
+	else h = seed + hash_prime5;
+	h += len;
+	for (; end - p >= 8; p += 8)
+	{
+		h ^= hash_round(0, read64(p));
+		h = rotate_left(h, 27) * hash_prime1 + hash_prime4;
+	}
+	if (end - p >= 4)
+	{
+		h ^= (uint64_t)(p[0] | p[1] << 8 | p[2] << 16 | (uint32_t)p[3] << 24) * hash_prime1;
+		h = rotate_left(h, 23) * hash_prime2 + hash_prime3;
+		p += 4;
+	}
+	for (; p != end; ++p)
+	{
+		h ^= *p * hash_prime5;
+		h = rotate_left(h, 11) * hash_prime1;
+	}
+	h ^= h >> 33;
+	h *= hash_prime2;
+	h ^= h >> 29;
+	h *= hash_prime3;
+	h ^= h >> 32;
+	return h;
+}
+
+/**
+ * Get the content hash of @a target, computing it only if the file changed
+ * since it was last hashed. Files that cannot be read, e.g. directories,
+ * are identified by their stamp instead.
+ * @return zero if the file does not exist.
+ */
+static uint64_t get_hash(target_id target)
+{
+	file_hash_t &h = file_hashes[target];
+	stat_result r;
+	if (!get_stat(target, r))
+	{
+		if (h.hash)
+		{
+			h = file_hash_t();
+			journal_hash(target);
+		}
+		return 0;
+	}
+	if (h.hash && h.size == r.size && h.mtime == (uint64_t)r.mtime && h.ino == r.ino)
+		return h.hash;
+	DEBUG << "hashing " << target_names[target] << std::endl;
+	uint64_t v;
+	mapped_file f;
+	if (f.open(target_names[target].c_str()) && f.size == r.size)
+		v = hash_bytes(f.data, f.size, 0);
+	else
+	{
+		uint64_t stamp[3] = { r.size, (uint64_t)r.mtime, r.ino };
+		v = hash_bytes((char const *)stamp, sizeof(stamp), 1);
+	}
+	if (!v) v = 1;
+	if (v != h.hash) h.inputs = 0;
+	h.size = r.size;
+	// A file modified during the current clock tick could still be modified
+	// without its stamp changing, so its hash is not reused.
+	h.mtime = r.mtime < current_time() ? r.mtime : 0;
+	h.ino = r.ino;
+	h.hash = v;
+	journal_hash(target);
+	return v;
+}
+
+/**
+ * Combine the names and the content hashes of the prerequisites of @a dep.
+ * The result does not depend on their order.
+ */
+static uint64_t hash_inputs(dependency_t const &dep)
+{
+	uint64_t h = 0;
+	for (id_list::const_iterator i = dep.deps.begin(),
+	     i_end = dep.deps.end(); i != i_end; ++i)
+	{
+		std::string const &n = target_names[*i];
+		h += hash_bytes(n.data(), n.size(), get_hash(*i));
+	}
+	return h ? h : 1;
+}
+
+/**
+ * Record that the targets of @a dep were built from the current content
+ * of its prerequisites.
+ */
+static void record_inputs(dependency_t const &dep)
+{
+	uint64_t h = hash_inputs(dep);
+	for (id_list::const_iterator i = dep.targets.begin(),
+	     i_end = dep.targets.end(); i != i_end; ++i)
+	{
+		if (!get_hash(*i)) continue;
+		file_hashes[*i].inputs = h;
+		journal_hash(*i);
+	}
+}
+
+/**
+ * Compute and memoize the status of @a target:
+ * - if the file does not exist, the target is obsolete,
+ * - if any dependency is obsolete or younger than the file, it is obsolete,
+ * - otherwise it is up-to-date.
+ *
+ * With the <tt>checksum</tt> option, a target is no longer obsolete because
+ * of the dates of its dependencies, if it is known which content they had
+ * when it was built. It is obsolete if this content changed.
+ *
+ * @note For rules with multiple targets, all the targets share the same
+ *       status. (If one is obsolete, they all are.) The second rule above
+ *       is modified in that case: the latest target is chosen, not the oldest!
+ */
+static status_t const &get_status(target_id target)
+{
+	status_t &ts = status[target];
+	if (ts.status != Unknown) return ts;
+	// Guard against circular dependencies.
+	ts.status = Uptodate;
+	DEBUG_open << "Checking status of " << target_names[target] << "... ";
+	if (dependencies[target].empty())
+	{
+		if (!get_mtime(target, ts.last))
+		{
+			DEBUG_close << "missing\n";
+			ts.status = Todo;
+			ts.last = 0;
+			return ts;
+		}
 		DEBUG_close << "up-to-date\n";
 		ts.status = Uptodate;
-		ts.last = s.st_mtime;
 		return ts;
 	}
 	if (obsolete_targets)
@@ -1950,42 +4110,63 @@ static status_t const &get_status(std::string const &target)
 		ts.last = 0;
 		return ts;
 	}
-	dependency_t const &dep = *j->second;
+	dependency_t const &dep = *dependencies[target];
 	status_e st = Uptodate;
-	time_t latest = 0;
-	for (string_list::const_iterator k = dep.targets.begin(),
+	file_time latest = 0;
+	uint64_t inputs = 0;
+	for (id_list::const_iterator k = dep.targets.begin(),
 	     k_end = dep.targets.end(); k != k_end; ++k)
 	{
-		struct stat s;
-		if (stat(k->c_str(), &s) != 0)
+		file_time mtime;
+		if (!get_mtime(*k, mtime))
 		{
-			if (st == Uptodate) DEBUG_close << *k << " missing\n";
-			s.st_mtime = 0;
+			if (st == Uptodate) DEBUG_close << target_names[*k] << " missing\n";
+			mtime = 0;
 			st = Todo;
 		}
-		status[*k].last = s.st_mtime;
-		if (s.st_mtime > latest) latest = s.st_mtime;
+		status_t &ts_ = status[*k];
+		ts_.last = mtime;
+		if (ts_.status == Unknown) ts_.status = Uptodate;
+		if (mtime > latest) latest = mtime;
+		if (!checksums || st != Uptodate) continue;
+		get_hash(*k);
+		uint64_t h = file_hashes[*k].inputs;
+		if (k == dep.targets.begin()) inputs = h;
+		else if (h != inputs) inputs = 0;
 	}
 	if (st != Uptodate) goto update;
-	for (string_set::const_iterator k = dep.deps.begin(),
+	for (id_list::const_iterator k = dep.deps.begin(),
 	     k_end = dep.deps.end(); k != k_end; ++k)
 	{
 		status_t const &ts_ = get_status(*k);
-		if (latest < ts_.last)
+		if (!inputs && latest < ts_.last)
 		{
-			DEBUG_close << "older than " << *k << std::endl;
+			DEBUG_close << "older than " << target_names[*k] << std::endl;
 			st = Todo;
 			goto update;
 		}
 		if (ts_.status != Uptodate && st != Recheck)
 		{
-			DEBUG << "obsolete dependency " << *k << std::endl;
+			DEBUG << "obsolete dependency " << target_names[*k] << std::endl;
 			st = Recheck;
 		}
 	}
+	if (checksums)
+	{
+		if (!inputs)
+		{
+			if (st == Uptodate) record_inputs(dep);
+		}
+		else if (hash_inputs(dep) != inputs)
+		{
+			DEBUG_close << "dependencies changed\n";
+			st = Todo;
+			goto update;
+		}
+	}
 	if (st == Uptodate) DEBUG_close << "all siblings up-to-date\n";
 	update:
-	for (string_list::const_iterator k = dep.targets.begin(),
+	for (id_list::const_iterator k = dep.targets.begin(),
 	     k_end = dep.targets.end(); k != k_end; ++k)
 	{
 		status[*k].status = st;
@@ -1995,30 +4176,51 @@ static status_t const &get_status(std::string const &target)
 
 /**
  * Change the status of @a target to #Remade or #Uptodate depending on whether
- * its modification time changed.
+ * its modification time changed, or its content with the <tt>checksum</tt>
+ * option.
  */
-static void update_status(std::string const &target)
+static void update_status(target_id target)
 {
-	DEBUG_open << "Rechecking status of " << target << "... ";
-	status_map::iterator i = status.find(target);
-	assert(i != status.end());
-	status_t &ts = i->second;
+	DEBUG_open << "Rechecking status of " << target_names[target] << "... ";
+	status_t &ts = status[target];
+	assert(ts.status != Unknown);
 	ts.status = Remade;
+	drop_prefetched(target);
+	if (checksums)
+	{
+		uint64_t old = file_hashes[target].hash;
+		if (!get_hash(target))
+		{
+			DEBUG_close << "missing\n";
+			ts.last = 0;
+		}
+		else if (file_hashes[target].hash != old)
+		{
+			DEBUG_close << "remade\n";
+			get_mtime(target, ts.last);
+		}
+		else
+		{
+			DEBUG_close << "unchanged\n";
+			ts.status = Uptodate;
+		}
+		return;
+	}
 	if (ts.last >= now)
 	{
 		DEBUG_close << "possibly remade\n";
 		return;
 	}
-	struct stat s;
-	if (stat(target.c_str(), &s) != 0)
+	file_time mtime;
+	if (!get_mtime(target, mtime))
 	{
 		DEBUG_close << "missing\n";
 		ts.last = 0;
 	}
-	else if (s.st_mtime != ts.last)
+	else if (mtime != ts.last)
 	{
 		DEBUG_close << "remade\n";
-		ts.last = s.st_mtime;
+		ts.last = mtime;
 	}
 	else
 	{
@@ -2030,25 +4232,24 @@ static void update_status(std::string const &target)
 /**
  * Check whether all the prerequisites of @a target ended being up-to-date.
  */
-static bool still_need_rebuild(std::string const &target)
+static bool still_need_rebuild(target_id target)
 {
-	status_map::const_iterator i = status.find(target);
-	assert(i != status.end());
-	if (i->second.status != RunningRecheck) return true;
-	DEBUG_open << "Rechecking obsoleteness of " << target << "... ";
-	dependency_map::const_iterator j = dependencies.find(target);
-	assert(j != dependencies.end());
-	dependency_t const &dep = *j->second;
-	for (string_set::const_iterator k = dep.deps.begin(),
+	assert(status[target].status != Unknown);
+	if (status[target].status != RunningRecheck) return true;
+	DEBUG_open << "Rechecking obsoleteness of " << target_names[target] << "... ";
+	assert(!dependencies[target].empty());
+	dependency_t const &dep = *dependencies[target];
+	for (id_list::const_iterator k = dep.deps.begin(),
 	     k_end = dep.deps.end(); k != k_end; ++k)
 	{
 		if (status[*k].status != Uptodate) return true;
 	}
-	for (string_list::const_iterator k = dep.targets.begin(),
+	for (id_list::const_iterator k = dep.targets.begin(),
 	     k_end = dep.targets.end(); k != k_end; ++k)
 	{
 		status[*k].status = Uptodate;
 	}
+	if (checksums) record_inputs(dep);
 	DEBUG_close << "no longer obsolete\n";
 	return false;
 }
@@ -2061,6 +4262,52 @@ static bool still_need_rebuild(std::string const &target)
  * @{
  */
 
+/**
+ * Record the duration of the script of @a job for all its targets.
+ */
+static void record_duration(job_t const &job)
+{
+	file_time d = (current_time() - job.start) / 1000000;
+	if (d < 1) d = 1;
+	for (string_list::const_iterator i = job.get_targets().begin(),
+	     i_end = job.get_targets().end(); i != i_end; ++i)
+	{
+		target_id t = intern(*i);
+		durations[t] = std::min<file_time>(d, 1 << 30);
+		journal_duration(t);
+	}
+}
+
+#ifndef WINDOWS
+/**
+ * Copy the output captured in file @a in to descriptor @a out, then
+ * close @a in.
+ */
+static void emit_output(int in, int out)
+{
+	if (in < 0) return;
+	if (lseek(in, 0, SEEK_SET) == 0)
+	{
+		char buf[65536];
+		ssize_t l;
+		while ((l = read(in, buf, sizeof(buf))) > 0)
+		{
+			char const *p = buf;
+			while (l > 0)
+			{
+				ssize_t w = write(out, p, l);
+				if (w < 0 && errno == EINTR) continue;
+				if (w <= 0) break;
+				p += w;
+				l -= w;
+			}
+			if (l > 0) break;
+		}
+	}
+	close(in);
+}
+#endif
+
 /**
  * Handle job completion.
  */
@@ -2069,7 +4316,16 @@ static void complete_job(int job_id, bool success, bool started = true)
 	DEBUG << "Completing job " << job_id << '\n';
 	job_map::iterator i = jobs.find(job_id);
 	assert(i != jobs.end());
-	string_list const &targets = i->second.rule.targets;
+#ifndef WINDOWS
+	// Display the captured output in one piece, just before the status.
+	if (i->second.output[0] >= 0)
+	{
+		std::cout.flush();
+		emit_output(i->second.output[0], 1);
+		emit_output(i->second.output[1], 2);
+	}
+#endif
+	string_list const &targets = i->second.get_targets();
 	if (success)
 	{
 		bool show = show_targets && started;
@@ -2077,10 +4333,13 @@ static void complete_job(int job_id, bool success, bool started = true)
 		for (string_list::const_iterator j = targets.begin(),
 		     j_end = targets.end(); j != j_end; ++j)
 		{
-			update_status(*j);
+			update_status(intern(*j));
 			if (show) std::cout << ' ' << *j;
 		}
 		if (show) std::cout << std::endl;
+		target_id t = intern(targets.front());
+		if (checksums && !dependencies[t].empty())
+			record_inputs(*dependencies[t]);
 	}
 	else
 	{
@@ -2089,8 +4348,9 @@ static void complete_job(int job_id, bool success, bool started = true)
 		     j_end = targets.end(); j != j_end; ++j)
 		{
 			std::cerr << ' ' << *j;
-			update_status(*j);
-			status_e &s = status[*j].status;
+			target_id t = intern(*j);
+			update_status(t);
+			status_e &s = status[t].status;
 			if (s != Uptodate)
 			{
 				DEBUG << "Removing " << *j << '\n';
@@ -2100,6 +4360,7 @@ static void complete_job(int job_id, bool success, bool started = true)
 		}
 		std::cerr << std::endl;
 	}
+	trace_job('e', "job", job_id, targets);
 	jobs.erase(i);
 }
 
@@ -2108,119 +4369,390 @@ static void complete_job(int job_id, bool success, bool started = true)
  */
 static std::string prepare_script(job_t const &job)
 {
-	std::string const &s = job.rule.script;
-	std::istringstream in(s);
-	std::ostringstream out;
-	size_t len = s.size();
+	script_template local;
+	script_template const *t = &local;
+	if (!job.rule->compiled.empty()) t = &*job.rule->compiled;
+	else compile_script(job.rule->script, local);
 
-	while (!in.eof())
+	std::string res;
+	res.reserve(job.rule->script.size());
+	for (script_template::const_iterator i = t->begin(),
+	     i_end = t->end(); i != i_end; ++i)
 	{
-		size_t pos = in.tellg(), p = s.find('$', pos);
-		if (p == std::string::npos || p == len - 1) p = len;
-		out.write(&s[pos], p - pos);
-		if (p == len) break;
-		++p;
-		switch (s[p])
+		switch (i->kind)
 		{
-		case '$':
-			out << '$';
-			in.seekg(p + 1);
+		case script_segment_t::Literal:
+			res += i->text;
 			break;
-		case '<':
-			if (!job.rule.deps.empty())
-				out << job.rule.deps.front();
-			in.seekg(p + 1);
+		case script_segment_t::FirstDep:
+			if (!job.get_deps().empty())
+				res += job.get_deps().front();
 			break;
-		case '^':
+		case script_segment_t::AllDeps:
 		{
 			bool first = true;
-			for (string_list::const_iterator i = job.rule.deps.begin(),
-			     i_end = job.rule.deps.end(); i != i_end; ++i)
+			for (string_list::const_iterator j = job.get_deps().begin(),
+			     j_end = job.get_deps().end(); j != j_end; ++j)
 			{
 				if (first) first = false;
-				else out << ' ';
-				out << *i;
+				else res += ' ';
+				res += *j;
 			}
-			in.seekg(p + 1);
 			break;
 		}
-		case '@':
-			assert(!job.rule.targets.empty());
-			out << job.rule.targets.front();
-			in.seekg(p + 1);
+		case script_segment_t::Target:
+			assert(!job.get_targets().empty());
+			res += job.get_targets().front();
 			break;
-		case '*':
-			out << job.stem;
-			in.seekg(p + 1);
+		case script_segment_t::Stem:
+			res += job.stem;
 			break;
-		case '(':
+		case script_segment_t::Variable:
 		{
-			in.seekg(p - 1);
+			string_list const *v = find_variable(&job.vars, i->text);
+			if (!v) break;
 			bool first = true;
+			for (string_list::const_iterator j = v->begin(),
+			     j_end = v->end(); j != j_end; ++j)
+			{
+				if (first) first = false;
+				else res += ' ';
+				res += *j;
+			}
+			break;
+		}
+		case script_segment_t::Expression:
+		{
+			std::istringstream in(i->text);
 			input_generator gen(in, &job.vars, true);
+			bool first = true;
 			while (true)
 			{
 				std::string w;
 				input_status s = gen.next(w);
-				if (s == SyntaxError)
-				{
-					// TODO
-					return "false";
-				}
+				if (s == SyntaxError) return "false";
 				if (s == Eof) break;
 				if (first) first = false;
-				else out << ' ';
-				out << w;
+				else res += ' ';
+				res += w;
 			}
 			break;
 		}
-		default:
-			// Let dollars followed by an unrecognized character
-			// go through. This differs from Make, which would
-			// use a one-letter variable.
-			out << '$';
-			in.seekg(p);
 		}
 	}
-
-	return out.str();
+	return res;
 }
 
+#ifndef WINDOWS
 /**
- * Execute the script from @a rule.
+ * Fill #job_env from the current environment.
  */
-static status_e run_script(int job_id, job_t const &job)
+static void init_job_env()
 {
-	ref_ptr<dependency_t> dep;
-	dep->targets = job.rule.targets;
-	dep->deps.insert(job.rule.deps.begin(), job.rule.deps.end());
-	if (show_targets) std::cout << "Building";
-	for (string_list::const_iterator i = job.rule.targets.begin(),
-	     i_end = job.rule.targets.end(); i != i_end; ++i)
+	for (char **e = environ; *e; ++e)
 	{
-		dependencies[*i] = dep;
-		if (show_targets) std::cout << ' ' << *i;
+		if (strncmp(*e, "REMAKE_JOB_ID=", 14)) job_env.push_back(*e);
 	}
-	if (show_targets) std::cout << std::endl;
-
-	std::string script = prepare_script(job);
+	job_env.push_back(NULL);
+	job_env.push_back(NULL);
+}
 
-	std::ostringstream job_id_buf;
-	job_id_buf << job_id;
-	std::string job_id_ = job_id_buf.str();
+/**
+ * Create an anonymous file, closed on exec. If @a in_memory is true, the
+ * file does not need to be backed by the file system.
+ * @return a descriptor, or -1.
+ */
+static int open_anonymous_file(bool in_memory)
+{
+	int fd = -1;
+#ifdef MFD_CLOEXEC
+	if (in_memory) fd = memfd_create("remake-script", MFD_CLOEXEC);
+#else
+	(void)in_memory;
+#endif
+	if (fd >= 0) return fd;
+	FILE *f = tmpfile();
+	if (!f) return -1;
+	fd = dup(fileno(f));
+	fclose(f);
+	if (fd < 0) return -1;
+	fcntl(fd, F_SETFD, FD_CLOEXEC);
+	return fd;
+}
 
-	DEBUG_open << "Starting script for job " << job_id << "... ";
-	if (script.empty())
+/**
+ * Store @a script into an anonymous file, so that the shell can read it
+ * without the server having to feed a pipe.
+ * @return a descriptor positioned at the start of the file, or -1.
+ */
+static int open_script_file(std::string const &script)
+{
+	int fd = open_anonymous_file(true);
+	if (fd < 0) return -1;
+	char const *p = script.data();
+	size_t len = script.length();
+	while (len > 0)
 	{
-		DEBUG_close << "no script\n";
-		complete_job(job_id, true);
-		return Remade;
+		ssize_t l = write(fd, p, len);
+		if (l <= 0) goto error;
+		p += l;
+		len -= l;
 	}
+	if (lseek(fd, 0, SEEK_SET) == 0) return fd;
+	error:
+	close(fd);
+	return -1;
+}
 
-	if (false)
+/**
+ * Copy file @a src to @a dst, sharing their blocks if the file system
+ * supports it.
+ */
+static bool copy_file(char const *src, char const *dst)
+{
+	int in = open(src, O_RDONLY | O_BINARY);
+	if (in < 0) return false;
+	struct stat s;
+	int out = -1;
+	bool ok = fstat(in, &s) == 0 &&
+		(out = open(dst, O_WRONLY | O_CREAT | O_TRUNC | O_BINARY, s.st_mode & 0777)) >= 0;
+#ifdef FICLONE
+	bool cloned = ok && ioctl(out, FICLONE, in) == 0;
+#else
+	bool cloned = false;
+#endif
+	while (ok && !cloned)
 	{
-		error:
-		DEBUG_close << "failed\n";
+		char buf[65536];
+		ssize_t l = read(in, buf, sizeof(buf));
+		if (l <= 0)
+		{
+			ok = l == 0;
+			break;
+		}
+		ok = write(out, buf, l) == l;
+	}
+	close(in);
+	if (out >= 0 && close(out) != 0) ok = false;
+	return ok;
+}
+
+/**
+ * Get the directory of the build cache entry for the targets of @a dep,
+ * built by @a script. The key of the entry combines the script, the names
+ * of the targets, and the names and content hashes of the prerequisites.
+ */
+static std::string cache_entry(std::string const &script, dependency_t const &dep)
+{
+	uint64_t k = hash_bytes(script.data(), script.size(), 0);
+	for (id_list::const_iterator i = dep.targets.begin(),
+	     i_end = dep.targets.end(); i != i_end; ++i)
+	{
+		std::string const &n = target_names[*i];
+		k = hash_bytes(n.data(), n.size() + 1, k);
+	}
+	uint64_t h = hash_inputs(dep);
+	k = hash_bytes((char const *)&h, sizeof(h), k);
+	char const *dir = getenv("REMAKE_CACHE");
+	std::string res = dir && *dir ? dir : ".remake.cache";
+	res += '/';
+	for (int i = 60; i >= 0; i -= 4)
+	{
+		res += "0123456789abcdef"[(k >> i) & 15];
+	}
+	return res;
+}
+
+/**
+ * Store the targets of @a job into the build cache, with the prerequisites
+ * they were built from. The entry is assembled in a temporary directory,
+ * so that it never appears partially written.
+ */
+static void store_in_cache(job_t const &job)
+{
+	target_id t = intern(job.get_targets().front());
+	if (dependencies[t].empty()) return;
+	dependency_t const &dep = *dependencies[t];
+	std::string script = prepare_script(job), entry = cache_entry(script, dep);
+	struct stat s;
+	if (stat(entry.c_str(), &s) == 0) return;
+	DEBUG_open << "Storing " << target_names[t] << " into " << entry << "... ";
+	std::ostringstream tmp_buf;
+	tmp_buf << entry << '.' << getpid();
+	std::string tmp = tmp_buf.str(), meta;
+	size_t nb = 0;
+	mkdir(entry.substr(0, entry.rfind('/')).c_str(), 0777);
+	if (mkdir(tmp.c_str(), 0777) != 0) goto error;
+	for (id_list::const_iterator i = dep.targets.begin(),
+	     i_end = dep.targets.end(); i != i_end; ++i, ++nb)
+	{
+		std::ostringstream name;
+		name << tmp << '/' << nb;
+		if (!copy_file(target_names[*i].c_str(), name.str().c_str())) goto error;
+	}
+	put_word(meta, dep.deps.size());
+	for (id_list::const_iterator i = dep.deps.begin(),
+	     i_end = dep.deps.end(); i != i_end; ++i)
+	{
+		put_string(meta, target_names[*i]);
+	}
+	{
+		std::ofstream out((tmp + "/meta").c_str(), std::ios::binary);
+		out << meta;
+		if (!out.good()) goto error;
+	}
+	if (rename(tmp.c_str(), entry.c_str()) == 0)
+	{
+		DEBUG_close << "done\n";
+		return;
+	}
+	error:
+	DEBUG_close << "failed\n";
+	remove((tmp + "/meta").c_str());
+	while (nb > 0)
+	{
+		std::ostringstream name;
+		name << tmp << '/' << --nb;
+		remove(name.str().c_str());
+	}
+	rmdir(tmp.c_str());
+}
+
+/**
+ * Restore the targets of @a dep from the build cache, if they were built by
+ * @a script from prerequisites with the same content as @a deps.
+ * The prerequisites recorded in the cache are then added to @a dep.
+ * @return false if there is no such entry or if some prerequisites might
+ *         still change.
+ */
+static bool restore_from_cache(std::string const &script, dependency_t &dep, id_list const &deps)
+{
+	for (id_list::const_iterator i = deps.begin(),
+	     i_end = deps.end(); i != i_end; ++i)
+	{
+		status_e st = get_status(*i).status;
+		if (st != Uptodate && st != Remade) return false;
+	}
+	ref_ptr<dependency_t> key;
+	key->targets = dep.targets;
+	key->deps = deps;
+	std::string entry = cache_entry(script, *key);
+	mapped_file meta;
+	if (!meta.open((entry + "/meta").c_str())) return false;
+	DEBUG_open << "Restoring " << target_names[dep.targets.front()] << " from " << entry << "... ";
+	word_reader in(meta.data, meta.data + meta.size);
+	size_t nb_deps = in.get();
+	id_list recorded;
+	for (size_t i = 0; in.ok && i < nb_deps; ++i)
+	{
+		std::string name;
+		in.get(name);
+		recorded.push_back(intern(name));
+	}
+	if (!in.ok || in.cur != in.end) goto error;
+	{
+		size_t nb = 0;
+		for (id_list::const_iterator i = dep.targets.begin(),
+		     i_end = dep.targets.end(); i != i_end; ++i, ++nb)
+		{
+			std::ostringstream name;
+			name << entry << '/' << nb;
+			std::string const &target = target_names[*i], tmp = target + ".remake-tmp";
+			if (!copy_file(name.str().c_str(), tmp.c_str()) ||
+			    rename(tmp.c_str(), target.c_str()) != 0)
+			{
+				remove(tmp.c_str());
+				goto error;
+			}
+			drop_prefetched(*i);
+		}
+	}
+	std::sort(recorded.begin(), recorded.end());
+	add_prerequisites(dep, recorded);
+	journal_dependency(dep);
+	DEBUG_close << "done\n";
+	return true;
+	error:
+	DEBUG_close << "failed\n";
+	return false;
+}
+#endif
+
+/**
+ * Get the weight of @a job, as given by variable <tt>.WEIGHT</tt>.
+ */
+static int job_weight(job_t const &job)
+{
+	string_list const *v = find_variable(&job.vars, ".WEIGHT");
+	if (!v || v->empty()) return 1;
+	return std::max(1, atoi(v->front().c_str()));
+}
+
+/**
+ * Execute the script from @a rule.
+ * With the <tt>cache</tt> option, the targets are restored from the build
+ * cache instead, if possible.
+ */
+static status_e run_script(int job_id, job_t const &job)
+{
+	id_list recorded;
+	if (use_cache)
+	{
+		ref_ptr<dependency_t> const &d = dependencies[intern(job.get_targets().front())];
+		if (!d.empty()) recorded = d->deps;
+	}
+	ref_ptr<dependency_t> dep;
+	intern_list(job.get_targets(), dep->targets);
+	insert_sorted(dep->deps, job.get_deps());
+	assign_dependency(dep);
+	if (show_targets)
+	{
+		std::cout << "Building";
+		for (string_list::const_iterator i = job.get_targets().begin(),
+		     i_end = job.get_targets().end(); i != i_end; ++i)
+		{
+			std::cout << ' ' << *i;
+		}
+		std::cout << std::endl;
+	}
+	journal_dependency(*dep);
+
+	std::string script = prepare_script(job);
+
+	std::ostringstream job_id_buf;
+	job_id_buf << job_id;
+	std::string job_id_ = job_id_buf.str();
+
+	DEBUG_open << "Starting script for job " << job_id << "... ";
+	if (script.empty())
+	{
+		DEBUG_close << "no script\n";
+		complete_job(job_id, true);
+		return Remade;
+	}
+
+#ifndef WINDOWS
+	if (use_cache)
+	{
+		insert_sorted(recorded, dep->deps);
+		if (restore_from_cache(script, *dep, recorded))
+		{
+			DEBUG_close << "restored\n";
+			complete_job(job_id, true);
+			return Remade;
+		}
+	}
+#endif
+
+	// Scripts might modify any file, so prefetched results become stale.
+	prefetched.clear();
+	jobs[job_id].start = current_time();
+	jobs[job_id].weight = job_weight(job);
+
+	if (false)
+	{
+		error:
+		DEBUG_close << "failed\n";
 		complete_job(job_id, false);
 		return Failed;
 	}
@@ -2262,47 +4794,128 @@ static status_e run_script(int job_id, job_t const &job)
 	CloseHandle(pfd[0]);
 	CloseHandle(pfd[1]);
 	++running_jobs;
+	busy_slots += job.weight;
 	job_pids[pi.hProcess] = job_id;
+	trace_job('b', "script", job_id, job.get_targets());
 	return Running;
 #else
-	int pfd[2];
-	if (false)
+	int fd = open_script_file(script);
+	if (fd < 0) goto error;
+	int *output = jobs[job_id].output;
+	if (sync_output)
 	{
-		error2:
-		close(pfd[0]);
-		close(pfd[1]);
-		goto error;
+		// Keep a single file if both outputs go to the same place, so that
+		// their relative order is preserved.
+		struct stat s1, s2;
+		bool same = fstat(1, &s1) == 0 && fstat(2, &s2) == 0 &&
+			s1.st_dev == s2.st_dev && s1.st_ino == s2.st_ino;
+		output[0] = open_anonymous_file(false);
+		if (!same && output[0] >= 0) output[1] = open_anonymous_file(false);
+		if (output[0] < 0 || (!same && output[1] < 0))
+		{
+			close(fd);
+			goto error;
+		}
 	}
-	if (pipe(pfd) == -1)
-		goto error;
-	if (setenv("REMAKE_JOB_ID", job_id_.c_str(), 1))
-		goto error2;
-	if (pid_t pid = vfork())
-	{
-		if (pid == -1) goto error2;
-		ssize_t len = script.length();
-		if (write(pfd[1], script.c_str(), len) < len)
-			std::cerr << "Unexpected failure while sending script to shell" << std::endl;
-		close(pfd[0]);
-		close(pfd[1]);
-		++running_jobs;
-		job_pids[pid] = job_id;
-		return Running;
-	}
-	// Child process starts here. Notice the use of vfork above.
+	if (job_env.empty()) init_job_env();
+	std::string job_var = "REMAKE_JOB_ID=" + job_id_;
+	job_env[job_env.size() - 2] = (char *)job_var.c_str();
 	char const *argv[5] = { "sh", "-e", "-s", NULL, NULL };
 	if (echo_scripts) argv[3] = "-v";
-	close(pfd[1]);
-	if (pfd[0] != 0)
+
+	// The script is the standard input of the shell. SIGCHLD is blocked
+	// in the server, so unblock it for the shell.
+	posix_spawn_file_actions_t actions;
+	posix_spawnattr_t attr;
+	sigset_t sigmask;
+	sigemptyset(&sigmask);
+	posix_spawn_file_actions_init(&actions);
+	posix_spawn_file_actions_adddup2(&actions, fd, 0);
+	if (output[0] >= 0)
 	{
-		dup2(pfd[0], 0);
-		close(pfd[0]);
+		posix_spawn_file_actions_adddup2(&actions, output[0], 1);
+		posix_spawn_file_actions_adddup2(&actions,
+			output[1] >= 0 ? output[1] : output[0], 2);
 	}
-	execve("/bin/sh", (char **)argv, environ);
-	_exit(EXIT_FAILURE);
+	posix_spawnattr_init(&attr);
+	posix_spawnattr_setsigmask(&attr, &sigmask);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETSIGMASK);
+	pid_t pid;
+	int res = posix_spawn(&pid, "/bin/sh", &actions, &attr,
+		(char **)argv, &job_env[0]);
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&actions);
+	close(fd);
+	if (res) goto error;
+	++running_jobs;
+	busy_slots += job.weight;
+	job_pids[pid] = job_id;
+	trace_job('b', "script", job_id, job.get_targets());
+	return Running;
 #endif
 }
 
+/**
+ * Compute and memoize the estimated time needed to build @a target, that
+ * is, the duration of its script plus the longest time needed to build one
+ * of its known prerequisites. Targets already built or being built count
+ * for nothing.
+ */
+static int critical_path(target_id target)
+{
+	if (critical_paths[target] >= 0) return critical_paths[target];
+	// Guard against circular dependencies.
+	critical_paths[target] = 0;
+	switch (status[target].status)
+	{
+	case Uptodate:
+	case Running:
+	case RunningRecheck:
+	case Remade:
+	case Failed:
+		return 0;
+	default:
+		break;
+	}
+	int longest = 0;
+	if (!dependencies[target].empty())
+	{
+		dependency_t const &dep = *dependencies[target];
+		for (id_list::const_iterator i = dep.deps.begin(),
+		     i_end = dep.deps.end(); i != i_end; ++i)
+		{
+			longest = std::max(longest, critical_path(*i));
+		}
+	}
+	return critical_paths[target] = longest + durations[target];
+}
+
+/**
+ * Sort @a targets so that the ones with the longest critical paths are
+ * started first, when several jobs can run at once. Otherwise, and for
+ * targets with the same estimate, the order is kept.
+ */
+static void prioritize(string_list &targets)
+{
+	if (max_active_jobs == 1 || targets.size() < 2) return;
+	std::vector<std::pair<int, size_t> > order;
+	std::vector<string_list::iterator> pos;
+	for (string_list::iterator i = targets.begin(),
+	     i_end = targets.end(); i != i_end; ++i)
+	{
+		order.push_back(std::make_pair(-critical_path(intern(*i)), pos.size()));
+		pos.push_back(i);
+	}
+	std::sort(order.begin(), order.end());
+	string_list l;
+	for (std::vector<std::pair<int, size_t> >::const_iterator i = order.begin(),
+	     i_end = order.end(); i != i_end; ++i)
+	{
+		l.splice(l.end(), targets, pos[i->second]);
+	}
+	targets.swap(l);
+}
+
 /**
  * Create a job for @a target according to the loaded rules.
  * Mark all the targets from the rule as running and reset their dependencies.
@@ -2310,53 +4923,55 @@ static status_e run_script(int job_id, job_t const &job)
  * If the rule has dependencies, create a new client to build them just
  * before @a current, and change @a current so that it points to it.
  */
-static status_e start(std::string const &target, client_list::iterator &current)
+static status_e start(target_id target, client_list::iterator &current)
 {
 	int job_id = job_counter++;
-	DEBUG_open << "Starting job " << job_id << " for " << target << "... ";
+	DEBUG_open << "Starting job " << job_id << " for " << target_names[target] << "... ";
 	job_t &job = jobs[job_id];
 	find_rule(job, target);
-	if (job.rule.targets.empty())
+	if (job.rule.empty())
 	{
 		status[target].status = Failed;
 		DEBUG_close << "failed\n";
-		std::cerr << "No rule for building " << target << std::endl;
+		std::cerr << "No rule for building " << target_names[target] << std::endl;
 		return Failed;
 	}
-	bool has_deps = !job.rule.deps.empty() || !job.rule.wdeps.empty();
+	trace_job('b', "job", job_id, job.get_targets());
+	bool has_deps = !job.get_deps().empty() || !job.get_wdeps().empty();
 	status_e st = Running;
 	if (has_deps && status[target].status == Recheck)
 		st = RunningRecheck;
-	for (string_list::const_iterator i = job.rule.targets.begin(),
-	     i_end = job.rule.targets.end(); i != i_end; ++i)
+	for (string_list::const_iterator i = job.get_targets().begin(),
+	     i_end = job.get_targets().end(); i != i_end; ++i)
 	{
-		status[*i].status = st;
+		status[intern(*i)].status = st;
 	}
-	if (propagate_vars) job.vars = current->vars;
-	for (assign_map::const_iterator i = job.rule.assigns.begin(),
-	     i_end = job.rule.assigns.end(); i != i_end; ++i)
+	// Share the variables of the client, and put the assignments of the
+	// rule, if any, into a frame of their own.
+	variable_scope inherited;
+	if (propagate_vars) inherited = current->vars;
+	assign_map const &assigns = job.get_assigns();
+	if (assigns.empty()) job.vars = inherited;
+	else job.vars->parent = inherited;
+	for (assign_map::const_iterator i = assigns.begin(),
+	     i_end = assigns.end(); i != i_end; ++i)
 	{
-		std::pair<variable_map::iterator, bool> k =
-			job.vars.insert(std::make_pair(i->first, string_list()));
-		string_list &v = k.first->second;
+		string_list &v = job.vars->vars[i->first];
 		if (i->second.append)
 		{
-			if (k.second)
-			{
-				variable_map::const_iterator j = variables.find(i->first);
-				if (j != variables.end()) v = j->second;
-			}
+			string_list const *w = find_variable(&inherited, i->first);
+			if (w) v = *w;
 		}
-		else if (!k.second) v.clear();
 		v.insert(v.end(), i->second.value.begin(), i->second.value.end());
 	}
 	if (has_deps)
 	{
 		current = clients.insert(current, client_t());
 		current->job_id = job_id;
-		current->pending = job.rule.deps;
+		current->pending = job.get_deps();
 		current->pending.insert(current->pending.end(),
-			job.rule.wdeps.begin(), job.rule.wdeps.end());
+			job.get_wdeps().begin(), job.get_wdeps().end());
+		prioritize(current->pending);
 		if (propagate_vars) current->vars = job.vars;
 		current->delayed = true;
 		return RunningRecheck;
@@ -2378,7 +4993,7 @@ static void complete_request(client_t &client, bool success)
 		{
 			job_map::const_iterator i = jobs.find(client.job_id);
 			assert(i != jobs.end());
-			if (still_need_rebuild(i->second.rule.targets.front()))
+			if (still_need_rebuild(intern(i->second.get_targets().front())))
 				run_script(client.job_id, i->second);
 			else complete_job(client.job_id, true, false);
 		}
@@ -2394,18 +5009,213 @@ static void complete_request(client_t &client, bool success)
 		close(client.socket);
 	#endif
 		--waiting_jobs;
+		job_map::iterator i = jobs.find(client.job_id);
+		if (i != jobs.end() && --i->second.waiting == 0)
+		{
+			busy_slots += i->second.weight;
+			trace_job('e', "wait", client.job_id, i->second.get_targets());
+		}
 	}
 
 	if (client.job_id < 0 && !success) build_failure = true;
 }
 
+/**
+ * Get the load of the machine. On Linux, this is the number of threads
+ * currently runnable besides the server, which reacts faster than the load
+ * average to the jobs being started.
+ */
+static double get_load()
+{
+#ifdef LINUX
+	std::ifstream in("/proc/loadavg");
+	double avg;
+	std::string runnable;
+	if (in >> avg >> avg >> avg >> runnable)
+	{
+		int n = atoi(runnable.c_str());
+		if (n > 0) return n - 1;
+	}
+#endif
+#ifndef WINDOWS
+	double l;
+	if (getloadavg(&l, 1) == 1) return l;
+#endif
+	return 0;
+}
+
+#ifdef LINUX
+/**
+ * Read the first line of file @a name.
+ */
+static std::string read_line(std::string const &name)
+{
+	std::ifstream in(name.c_str());
+	std::string l;
+	std::getline(in, l);
+	return l;
+}
+
+/**
+ * Get the memory in megabytes that jobs can still use: the memory available
+ * on the system, or the room left below the memory limit of the cgroup of
+ * the server, if smaller. Return -1 if unknown.
+ */
+static long get_available_memory()
+{
+	long res = -1;
+	std::ifstream meminfo("/proc/meminfo");
+	std::string l;
+	while (std::getline(meminfo, l))
+	{
+		long kb;
+		if (sscanf(l.c_str(), "MemAvailable: %ld kB", &kb) != 1) continue;
+		res = kb / 1024;
+		break;
+	}
+	static std::string cgroup;
+	if (cgroup.empty())
+	{
+		std::ifstream in("/proc/self/cgroup");
+		while (std::getline(in, l))
+		{
+			if (l.compare(0, 3, "0::") == 0)
+				cgroup = "/sys/fs/cgroup" + l.substr(3) + '/';
+		}
+		if (cgroup.empty()) cgroup = "/";
+	}
+	if (cgroup.size() > 1)
+	{
+		std::string max = read_line(cgroup + "memory.max"),
+			current = read_line(cgroup + "memory.current");
+		if (!max.empty() && max != "max" && !current.empty())
+		{
+			long room = (atoll(max.c_str()) - atoll(current.c_str())) >> 20;
+			if (res < 0 || room < res) res = room;
+		}
+	}
+	return res;
+}
+
+/**
+ * Get the share of the last ten seconds during which some threads were
+ * stalled on memory, as a percentage. Return 0 if unknown.
+ */
+static double get_memory_pressure()
+{
+	double avg10;
+	std::string l = read_line("/proc/pressure/memory");
+	if (sscanf(l.c_str(), "some avg10=%lf", &avg10) != 1) return 0;
+	return avg10;
+}
+#endif
+
+/**
+ * Check whether the load or the memory of the machine prevents new jobs
+ * from starting.
+ */
+static bool overloaded()
+{
+	if (max_load > 0)
+	{
+		double l = get_load();
+		if (l >= max_load)
+		{
+			DEBUG << "load " << l << " too high\n";
+			return true;
+		}
+	}
+#ifdef LINUX
+	if (memory_headroom > 0)
+	{
+		long m = get_available_memory();
+		if (m >= 0 && m < memory_headroom)
+		{
+			DEBUG << "only " << m << "MB of memory available\n";
+			return true;
+		}
+		// Memory might be available only because it is being reclaimed.
+		double p = get_memory_pressure();
+		if (p > 10)
+		{
+			DEBUG << "memory pressure " << p << "% too high\n";
+			return true;
+		}
+	}
+#endif
+	return false;
+}
+
+#ifndef WINDOWS
+static void watch_fd(int fd, fd_handler h);
+static void unwatch_fd(int fd);
+
+/**
+ * Stop watching the jobserver once it has tokens available. The next call
+ * to #has_free_slots reads them.
+ */
+static void handle_jobserver(int fd)
+{
+	unwatch_fd(fd);
+}
+
+/**
+ * Read enough tokens from the jobserver to start one more job. If there are
+ * not enough of them, watch the jobserver until it gets some.
+ * @return false if a job cannot be started yet.
+ */
+static bool acquire_tokens()
+{
+	if (jobserver_fd < 0) return true;
+	while ((int)jobserver_tokens.size() < busy_slots)
+	{
+		char c;
+		ssize_t l = read(jobserver_fd, &c, 1);
+		if (l == 1)
+		{
+			jobserver_tokens += c;
+			continue;
+		}
+		if (l < 0 && errno == EINTR) continue;
+		if ((size_t)jobserver_fd >= fd_handlers.size() || !fd_handlers[jobserver_fd])
+			watch_fd(jobserver_fd, &handle_jobserver);
+		return false;
+	}
+	return true;
+}
+
+/**
+ * Write back to the jobserver the tokens that the running jobs do not need.
+ */
+static void release_tokens()
+{
+	while (!jobserver_tokens.empty() && (int)jobserver_tokens.size() >= busy_slots)
+	{
+		char c = jobserver_tokens[jobserver_tokens.size() - 1];
+		if (write(jobserver_fd, &c, 1) < 0 && errno == EINTR) continue;
+		jobserver_tokens.erase(jobserver_tokens.size() - 1);
+	}
+}
+#endif
+
 /**
  * Return whether there are slots for starting new jobs.
+ * There are always some if no jobs are running, whatever the load.
  */
 static bool has_free_slots()
 {
-	if (max_active_jobs <= 0) return true;
-	return running_jobs - waiting_jobs < max_active_jobs;
+	if (max_active_jobs > 0 && busy_slots >= max_active_jobs) return false;
+	if (busy_slots <= 0) return true;
+	if (overloaded())
+	{
+		throttled = true;
+		return false;
+	}
+#ifndef WINDOWS
+	return acquire_tokens();
+#else
+	return true;
+#endif
 }
 
 /**
@@ -2421,7 +5231,7 @@ static bool has_free_slots()
  *
  * @invariant New free slots cannot appear during a run, since the only way to
  *            decrease #running_jobs is #finalize_job and the only way to
- *            increase #waiting_jobs is #accept_client. None of these functions
+ *            increase #waiting_jobs is #handle_connection. None of these functions
  *            are called during a run. So breaking out as soon as there are no
  *            free slots left is fine.
  */
@@ -2439,13 +5249,11 @@ static bool handle_clients()
 		DEBUG_open << "Handling client from job " << i->job_id << "... ";
 
 		// Remove running targets that have finished.
-		for (string_set::iterator j = i->running.begin(), j_next = j,
+		for (id_set::iterator j = i->running.begin(), j_next = j,
 		     j_end = i->running.end(); j != j_end; j = j_next)
 		{
 			++j_next;
-			status_map::const_iterator k = status.find(*j);
-			assert(k != status.end());
-			switch (k->second.status)
+			switch (status[*j].status)
 			{
 			case Running:
 			case RunningRecheck:
@@ -2458,6 +5266,7 @@ static bool handle_clients()
 			case Remade:
 				i->running.erase(j);
 				break;
+			case Unknown:
 			case Recheck:
 			case Todo:
 				assert(false);
@@ -2467,10 +5276,13 @@ static bool handle_clients()
 		// Start pending targets.
 		while (!i->pending.empty())
 		{
-			std::string target = i->pending.front();
+			target_id target = intern(i->pending.front());
 			i->pending.pop_front();
 			switch (get_status(target).status)
 			{
+			case Unknown:
+				assert(false);
+				break;
 			case Running:
 			case RunningRecheck:
 				i->running.insert(target);
@@ -2536,33 +5348,141 @@ static bool handle_clients()
 	goto restart;
 }
 
+#ifndef WINDOWS
 /**
- * Create a named unix socket that listens for build requests. Also set
- * the REMAKE_SOCKET environment variable that will be inherited by all
- * the job scripts.
+ * Watch descriptor @a fd, so that #server_loop calls @a h whenever it is
+ * readable.
  */
-static void create_server()
+static void watch_fd(int fd, fd_handler h)
 {
-	if (false)
-	{
-		error:
-		perror("Failed to create server");
-#ifndef WINDOWS
-		error2:
+	if (fd_handlers.size() <= (size_t)fd) fd_handlers.resize(fd + 1);
+	fd_handlers[fd] = h;
+#ifdef LINUX
+	if (epoll_fd < 0) return;
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.fd = fd;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &ev) == 0) return;
+	perror("Failed to watch descriptor");
+	exit(EXIT_FAILURE);
 #endif
-		exit(EXIT_FAILURE);
-	}
-	DEBUG_open << "Creating server... ";
+}
 
-#ifdef WINDOWS
-	// Prepare a windows socket.
-	struct sockaddr_in socket_addr;
-	socket_addr.sin_family = AF_INET;
-	socket_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
-	socket_addr.sin_port = 0;
+/**
+ * Stop watching descriptor @a fd.
+ */
+static void unwatch_fd(int fd)
+{
+	fd_handlers[fd] = NULL;
+#ifdef LINUX
+	if (epoll_fd >= 0) epoll_ctl(epoll_fd, EPOLL_CTL_DEL, fd, NULL);
+#endif
+}
+#endif
 
-	// Create and listen to the socket.
-	socket_fd = socket(AF_INET, SOCK_STREAM, 0);
+/**
+ * Connect to the jobserver of GNU make, if remake was started by it and
+ * @a jobs_given is false. The number of jobs is then bounded by the tokens
+ * of the jobserver only. Otherwise, if several jobs can run at once, create
+ * a jobserver whose tokens are shared by remake and by the GNU make and
+ * ninja processes started by the scripts.
+ */
+static void init_jobserver(bool jobs_given)
+{
+	char const *flags = getenv("MAKEFLAGS");
+	std::string makeflags = flags ? flags : "";
+	size_t pos = makeflags.rfind("--jobserver-auth=");
+	if (pos != std::string::npos && !jobs_given)
+	{
+		pos += 17;
+		std::string auth = makeflags.substr(pos, makeflags.find(' ', pos) - pos);
+		DEBUG_open << "Connecting to jobserver " << auth << "... ";
+		int fd = -1;
+		if (auth.compare(0, 5, "fifo:") == 0)
+			fd = open(auth.c_str() + 5, O_RDWR | O_NONBLOCK);
+#ifdef LINUX
+		else
+		{
+			// Open the pipe anew, so that it can be made non-blocking
+			// without affecting the other processes.
+			int r = atoi(auth.c_str());
+			struct stat st;
+			if (fstat(r, &st) == 0 && S_ISFIFO(st.st_mode))
+			{
+				std::ostringstream name;
+				name << "/proc/self/fd/" << r;
+				fd = open(name.str().c_str(), O_RDWR | O_NONBLOCK);
+			}
+		}
+#endif
+		if (fd < 0)
+		{
+			DEBUG_close << "unavailable\n";
+			return;
+		}
+		fcntl(fd, F_SETFD, FD_CLOEXEC);
+		jobserver_fd = fd;
+		max_active_jobs = 0;
+		DEBUG_close << "done\n";
+		return;
+	}
+	if (max_active_jobs <= 1) return;
+
+	DEBUG_open << "Creating jobserver... ";
+	char *name = tempnam(NULL, "rmk-");
+	if (!name) goto error;
+	jobserver_fifo = name;
+	free(name);
+	if (mkfifo(jobserver_fifo.c_str(), 0600)) goto error;
+	jobserver_fd = open(jobserver_fifo.c_str(), O_RDWR | O_NONBLOCK);
+	if (jobserver_fd < 0) goto error;
+	fcntl(jobserver_fd, F_SETFD, FD_CLOEXEC);
+	{
+		std::string tokens(max_active_jobs - 1, '+');
+		if (write(jobserver_fd, tokens.data(), tokens.size()) != (ssize_t)tokens.size())
+			goto error;
+		std::ostringstream buf;
+		if (!makeflags.empty()) buf << makeflags << ' ';
+		buf << "-j" << max_active_jobs << " --jobserver-auth=fifo:" << jobserver_fifo;
+		if (setenv("MAKEFLAGS", buf.str().c_str(), 1)) goto error;
+	}
+	DEBUG_close << jobserver_fifo << '\n';
+	return;
+
+	error:
+	DEBUG_close << "failed\n";
+	perror("Failed to create jobserver");
+	exit(EXIT_FAILURE);
+}
+
+/**
+ * Create a named unix socket that listens for build requests. Also set
+ * the REMAKE_SOCKET environment variable that will be inherited by all
+ * the job scripts.
+ */
+static void create_server()
+{
+	if (false)
+	{
+		error:
+		perror("Failed to create server");
+#ifndef WINDOWS
+		error2:
+#endif
+		exit(EXIT_FAILURE);
+	}
+	DEBUG_open << "Creating server... ";
+
+#ifdef WINDOWS
+	// Prepare a windows socket.
+	struct sockaddr_in socket_addr;
+	socket_addr.sin_family = AF_INET;
+	socket_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
+	socket_addr.sin_port = 0;
+
+	// Create and listen to the socket.
+	socket_fd = socket(AF_INET, SOCK_STREAM, 0);
 	if (socket_fd == INVALID_SOCKET) goto error;
 	if (!SetHandleInformation((HANDLE)socket_fd, HANDLE_FLAG_INHERIT, 0))
 		goto error;
@@ -2604,12 +5524,13 @@ static void create_server()
 
 	// Create and listen to the socket.
 #ifdef LINUX
-	socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+	socket_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC | SOCK_NONBLOCK, 0);
 	if (socket_fd == INVALID_SOCKET) goto error;
 #else
 	socket_fd = socket(AF_UNIX, SOCK_STREAM, 0);
 	if (socket_fd == INVALID_SOCKET) goto error;
 	if (fcntl(socket_fd, F_SETFD, FD_CLOEXEC) < 0) goto error;
+	if (fcntl(socket_fd, F_SETFL, O_NONBLOCK) < 0) goto error;
 #endif
 	if (bind(socket_fd, (struct sockaddr *)&socket_addr, len))
 		goto error;
@@ -2618,239 +5539,904 @@ static void create_server()
 }
 
 /**
- * Accept a connection from a client, get the job it spawned from,
- * get the targets, and mark them as dependencies of the job targets.
+ * Parse the records received so far on connection @a conn and remove them
+ * from its buffer. Targets are added to the dependencies of the job as soon
+ * as they are received.
+ * @return 1 if the request is complete, 0 if more data is needed, -1 if it
+ *         is ill-formed.
+ */
+static int parse_client_message(connection_t &conn)
+{
+	client_t &proc = conn.client;
+	std::string &buf = conn.buf;
+	size_t pos = 0;
+	if (!conn.has_job_id)
+	{
+		if (buf.size() < sizeof(int)) return 0;
+		memcpy(&proc.job_id, buf.data(), sizeof(int));
+		conn.has_job_id = true;
+		pos = sizeof(int);
+		if (proc.job_id < 0)
+		{
+			if (!daemon_server) return -1;
+			DEBUG << "receiving top-level request\n";
+		}
+		else
+		{
+			job_map::const_iterator i = jobs.find(proc.job_id);
+			if (i == jobs.end()) return -1;
+			DEBUG << "receiving request from job " << proc.job_id << std::endl;
+			if (propagate_vars) proc.vars->parent = i->second.vars;
+		}
+	}
+	target_id job_target = -1;
+	if (proc.job_id >= 0)
+	{
+		job_map::const_iterator i = jobs.find(proc.job_id);
+		if (i == jobs.end()) return -1;
+		job_target = intern(i->second.get_targets().front());
+	}
+
+	// Parse the targets and the variable assignments.
+	// Mark the targets as dependencies of the job targets.
+	int res = 0;
+	for (size_t end; (end = buf.find('\0', pos)) != std::string::npos;)
+	{
+		char const *p = buf.data() + pos;
+		size_t len = end - pos;
+		pos = end + 1;
+		if (len == 0)
+		{
+			res = 1;
+			break;
+		}
+		switch (*p)
+		{
+		case 'T':
+		{
+			if (len == 1) return -1;
+			std::string target(p + 1, len - 1);
+			DEBUG << "adding dependency " << target << " to job\n";
+			proc.pending.push_back(target);
+			if (job_target < 0) break;
+			target_id t = intern(target);
+			add_prerequisites(*dependencies[job_target], id_list(1, t));
+			break;
+		}
+		case 'O':
+		{
+			if (job_target >= 0) return -1;
+			conn.options.push_back(std::string(p + 1, len - 1));
+			break;
+		}
+		case 'V':
+		{
+			if (len == 1 || job_target < 0) return -1;
+			std::string var(p + 1, len - 1);
+			DEBUG << "adding variable " << var << " to job\n";
+			conn.last_var = &proc.vars->vars[var];
+			conn.last_var->clear();
+			break;
+		}
+		case 'W':
+		{
+			if (!conn.last_var) return -1;
+			conn.last_var->push_back(std::string(p + 1, len - 1));
+			break;
+		}
+		default:
+			return -1;
+		}
+	}
+	buf.erase(0, pos);
+	if (res == 0 || job_target < 0) return res;
+
+	if (!propagate_vars && !proc.vars.empty())
+	{
+		std::cerr << "Assignments are ignored unless 'variable-propagation' is enabled" << std::endl;
+		proc.vars = variable_scope();
+	}
+	else if (!proc.vars.empty() && proc.vars->vars.empty())
+	{
+		// Skip the frame if the request did not assign anything.
+		variable_scope inherited = proc.vars->parent;
+		proc.vars = inherited;
+	}
+	journal_dependency(*dependencies[job_target]);
+	return 1;
+}
+
+/**
+ * Receive data from client connection @a fd and parse it. Once the request
+ * is complete, put it at the front of #clients.
+ */
+static void handle_connection(socket_t fd)
+{
+	connection_map::iterator i = connections.find(fd);
+	assert(i != connections.end());
+	connection_t &conn = i->second;
+	DEBUG_open << "Handling client request... ";
+
+	if (false)
+	{
+		error:
+		DEBUG_close << "failed\n";
+		std::cerr << "Received an ill-formed client message" << std::endl;
+	#ifdef WINDOWS
+		closesocket(fd);
+	#else
+		unwatch_fd(fd);
+		close(fd);
+		for (std::vector<int>::const_iterator j = conn.fds.begin(),
+		     j_end = conn.fds.end(); j != j_end; ++j)
+		{
+			close(*j);
+		}
+	#endif
+		connections.erase(i);
+		return;
+	}
+
+	while (true)
+	{
+		char data[4096];
+	#ifdef WINDOWS
+		ssize_t l = recv(fd, data, sizeof(data), 0);
+	#else
+		// Top-level requests pass the output descriptors of the client.
+		struct iovec iov = { data, sizeof(data) };
+		char cbuf[CMSG_SPACE(2 * sizeof(int))];
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = cbuf;
+		msg.msg_controllen = sizeof(cbuf);
+		ssize_t l = recvmsg(fd, &msg, 0);
+		if (l < 0 && errno == EINTR) continue;
+		if (l < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) return;
+		for (struct cmsghdr *c = CMSG_FIRSTHDR(&msg); c; c = CMSG_NXTHDR(&msg, c))
+		{
+			if (c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) continue;
+			int const *p = (int const *)CMSG_DATA(c);
+			for (int const *p_end = (int const *)((char const *)c + c->cmsg_len); p < p_end; ++p)
+			{
+				fcntl(*p, F_SETFD, FD_CLOEXEC);
+				conn.fds.push_back(*p);
+			}
+		}
+	#endif
+		if (l <= 0) goto error;
+		conn.buf.append(data, l);
+		int res = parse_client_message(conn);
+		if (res < 0) goto error;
+		if (res > 0) break;
+	}
+
+#ifndef WINDOWS
+	unwatch_fd(fd);
+#endif
+	conn.client.socket = fd;
+	if (conn.client.job_id < 0)
+	{
+		daemon_requests.push_back(conn);
+		connections.erase(i);
+		return;
+	}
+	prioritize(conn.client.pending);
+	clients.push_front(conn.client);
+	connections.erase(i);
+	++waiting_jobs;
+	job_map::iterator j = jobs.find(conn.client.job_id);
+	if (j != jobs.end() && j->second.waiting++ == 0)
+	{
+		busy_slots -= j->second.weight;
+		trace_job('b', "wait", conn.client.job_id, j->second.get_targets());
+	}
+}
+
+/**
+ * Accept a connection from a client. On Windows, the request is received
+ * right away. Otherwise, the connection is watched by #server_loop, so that
+ * the request is parsed as it arrives.
+ * @return false if there was no pending connection.
+ */
+static bool accept_client()
+{
+	// Accept connection.
+#ifdef WINDOWS
+	socket_t fd = accept(socket_fd, NULL, NULL);
+	if (fd == INVALID_SOCKET) return false;
+	if (!SetHandleInformation((HANDLE)fd, HANDLE_FLAG_INHERIT, 0))
+	{
+		error2:
+		std::cerr << "Unexpected failure while setting connection with client" << std::endl;
+		closesocket(fd);
+		return true;
+	}
+	// WSAEventSelect puts sockets into nonblocking mode, so disable it here.
+	u_long nbio = 0;
+	if (ioctlsocket(fd, FIONBIO, &nbio)) goto error2;
+#elif defined(LINUX)
+	int fd = accept4(socket_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+	if (fd < 0) return false;
+#else
+	int fd = accept(socket_fd, NULL, NULL);
+	if (fd < 0) return false;
+	if (fcntl(fd, F_SETFD, FD_CLOEXEC) < 0 || fcntl(fd, F_SETFL, O_NONBLOCK) < 0)
+	{
+		close(fd);
+		return true;
+	}
+#endif
+	connections[fd];
+#ifndef WINDOWS
+	watch_fd(fd, &handle_connection);
+#endif
+	handle_connection(fd);
+	return true;
+}
+
+/**
+ * Handle child process exit status.
+ */
+static void finalize_job(pid_t pid, bool res)
+{
+	pid_job_map::iterator i = job_pids.find(pid);
+	assert(i != job_pids.end());
+	int job_id = i->second;
+	job_pids.erase(i);
+	--running_jobs;
+	job_t const &job = jobs[job_id];
+	if (!job.waiting) busy_slots -= job.weight;
+	trace_job('e', "script", job_id, job.get_targets());
+	if (res) record_duration(job);
+#ifndef WINDOWS
+	if (res && use_cache) store_in_cache(jobs[job_id]);
+#endif
+	complete_job(job_id, res);
+}
+
+#ifndef WINDOWS
+/**
+ * Call #finalize_job for all the child processes that have ended.
+ */
+static void reap_children()
+{
+	pid_t pid;
+	int status;
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+	{
+		bool res = WIFEXITED(status) && WEXITSTATUS(status) == 0;
+		finalize_job(pid, res);
+	}
+}
+
+/**
+ * Accept all the pending connections on the server socket.
+ */
+static void handle_server_socket(int)
+{
+	while (accept_client()) {}
+}
+
+#ifdef LINUX
+/**
+ * Drain the signal descriptor @a fd, then collect ended child processes.
+ */
+static void handle_signal_fd(int fd)
+{
+	struct signalfd_siginfo si;
+	while (read(fd, &si, sizeof(si)) > 0)
+	{
+		if (si.ssi_signo != SIGCHLD) sigterm_handler(si.ssi_signo);
+	}
+	reap_children();
+}
+#endif
+
+/**
+ * Watch the server socket. On Linux, also create the epoll instance and
+ * a signal descriptor for SIGCHLD, which is already blocked, and for the
+ * termination signals of the daemon; if that fails, #server_loop falls
+ * back to pselect.
+ */
+static void setup_events()
+{
+#ifdef LINUX
+	sigset_t sigmask;
+	sigemptyset(&sigmask);
+	sigaddset(&sigmask, SIGCHLD);
+	if (daemon_server)
+	{
+		sigaddset(&sigmask, SIGINT);
+		sigaddset(&sigmask, SIGTERM);
+	}
+	epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	int sig_fd = signalfd(-1, &sigmask, SFD_NONBLOCK | SFD_CLOEXEC);
+	if (epoll_fd >= 0 && sig_fd >= 0)
+	{
+		watch_fd(sig_fd, &handle_signal_fd);
+	}
+	else
+	{
+		DEBUG << "falling back to pselect\n";
+		if (epoll_fd >= 0) close(epoll_fd);
+		if (sig_fd >= 0) close(sig_fd);
+		epoll_fd = -1;
+	}
+#endif
+	watch_fd(socket_fd, &handle_server_socket);
+}
+#endif
+
+/**
+ * Wait for some events, e.g. connections from clients or ending child
+ * processes, and handle them.
+ */
+static void handle_events()
+{
+	DEBUG_open << "Handling events... ";
+#ifdef WINDOWS
+	size_t len = job_pids.size() + 1;
+	HANDLE h[len];
+	int num = 0;
+	for (pid_job_map::const_iterator i = job_pids.begin(),
+	     i_end = job_pids.end(); i != i_end; ++i, ++num)
+	{
+		h[num] = i->first;
+	}
+	WSAEVENT aev = WSACreateEvent();
+	h[num] = aev;
+	WSAEventSelect(socket_fd, aev, FD_ACCEPT);
+	DWORD w = WaitForMultipleObjects(len, h, false, throttled ? 500 : INFINITE);
+	throttled = false;
+	WSAEventSelect(socket_fd, aev, 0);
+	WSACloseEvent(aev);
+	if (len <= w)
+		return;
+	if (w == len - 1)
+	{
+		accept_client();
+		return;
+	}
+	pid_t pid = h[w];
+	DWORD s = 0;
+	bool res = GetExitCodeProcess(pid, &s) && s == 0;
+	CloseHandle(pid);
+	finalize_job(pid, res);
+#else
+#ifdef LINUX
+	if (epoll_fd >= 0)
+	{
+		struct epoll_event ev[64];
+		int ret = epoll_wait(epoll_fd, ev, 64, throttled ? 500 : -1);
+		throttled = false;
+		for (int j = 0; j < ret; ++j)
+		{
+			int fd = ev[j].data.fd;
+			// A previous handler might have stopped watching it.
+			if (fd_handlers[fd]) fd_handlers[fd](fd);
+		}
+		return;
+	}
+#endif
+	sigset_t emptymask;
+	sigemptyset(&emptymask);
+	fd_set fdset;
+	FD_ZERO(&fdset);
+	int max_fd = -1;
+	for (int fd = 0, fd_end = fd_handlers.size(); fd != fd_end; ++fd)
+	{
+		if (!fd_handlers[fd]) continue;
+		FD_SET(fd, &fdset);
+		max_fd = fd;
+	}
+	// The load and the memory are polled while they prevent jobs from starting.
+	struct timespec timeout = { 0, 500000000 };
+	int ret = pselect(max_fd + 1, &fdset, NULL, NULL, throttled ? &timeout : NULL, &emptymask);
+	throttled = false;
+	for (int fd = 0; ret > 0 && fd <= max_fd; ++fd)
+	{
+		if (fd_handlers[fd] && FD_ISSET(fd, &fdset)) fd_handlers[fd](fd);
+	}
+	if (!got_SIGCHLD) return;
+	got_SIGCHLD = 0;
+	reap_children();
+#endif
+}
+
+/**
+ * Loop until all the jobs have finished.
+ *
+ * @post There are no client requests left, not even virtual ones.
+ */
+static void server_loop()
+{
+	while (handle_clients())
+	{
+#ifndef WINDOWS
+		release_tokens();
+#endif
+		handle_events();
+	}
+#ifndef WINDOWS
+	release_tokens();
+#endif
+	assert(clients.empty());
+}
+
+/**
+ * Forget the rules and load them again from @a remakefile.
+ */
+static void reload_rules(std::string const &remakefile)
+{
+	variables.clear();
+	propagate_vars = false;
+	checksums = false;
+	use_cache = false;
+	phony_targets.clear();
+	specific_rules.assign(specific_rules.size(), ref_ptr<rule_t>());
+	generic_rules.clear();
+	first_target.clear();
+	load_rules(remakefile);
+}
+
+/**
+ * Build @a targets, or the first target if there are none, and loop until
+ * all the requests have completed.
+ * If Remakefile is obsolete, perform a first run with it only, then reload
+ * the rules, and perform a second with the original clients.
+ */
+static void build(std::string const &remakefile, string_list const &targets)
+{
+	file_time begin = trace_file ? trace_clock() : 0;
+	if (!obsolete_targets)
+	{
+		string_list roots = targets;
+		if (roots.empty() && !first_target.empty())
+			roots.push_back(first_target);
+		roots.push_back(remakefile);
+		prefetch_status(roots);
+	}
+	bool remakefile_obsolete = get_status(intern(remakefile)).status != Uptodate;
+	trace_phase("check_status", begin);
+	if (remakefile_obsolete)
+	{
+		clients.push_back(client_t());
+		clients.back().pending.push_back(remakefile);
+		server_loop();
+		if (build_failure) return;
+		reload_rules(remakefile);
+	}
+	critical_paths.assign(critical_paths.size(), -1);
+	clients.push_back(client_t());
+	if (!targets.empty()) clients.back().pending = targets;
+	else if (!first_target.empty())
+		clients.back().pending.push_back(first_target);
+	prioritize(clients.back().pending);
+	server_loop();
+}
+
+/**
+ * Load dependencies and rules, listen to client requests, and loop until
+ * all the requests have completed.
+ */
+static void server_mode(std::string const &remakefile, string_list const &targets)
+{
+	load_dependencies();
+	load_rules(remakefile);
+	create_server();
+#ifndef WINDOWS
+	setup_events();
+#endif
+	build(remakefile, targets);
+	close(socket_fd);
+#ifndef WINDOWS
+	remove(socket_name);
+	free(socket_name);
+	if (!jobserver_fifo.empty()) remove(jobserver_fifo.c_str());
+#endif
+	save_dependencies();
+	if (show_targets && changed_prefix_dir)
+	{
+		std::cout << "remake: Leaving directory `" << prefix_dir << '\'' << std::endl;
+	}
+	close_trace();
+	exit(build_failure ? EXIT_FAILURE : EXIT_SUCCESS);
+}
+
+/**
+ * Load dependencies and rules, then print the targets that transitively
+ * depend on any of @a files, as known from the previous builds and the
+ * static rules. Nothing is built.
+ */
+static void affected_mode(std::string const &remakefile, string_list const &files)
+{
+	load_dependencies();
+	load_rules(remakefile);
+	std::vector<bool> seen(target_names.size());
+	id_list todo;
+	for (string_list::const_iterator i = files.begin(),
+	     i_end = files.end(); i != i_end; ++i)
+	{
+		target_id t = find_target(*i);
+		if (t < 0) continue;
+		id_list const &l = reverse_dependencies[t];
+		todo.insert(todo.end(), l.begin(), l.end());
+	}
+	string_list affected;
+	while (!todo.empty())
+	{
+		target_id t = todo.back();
+		todo.pop_back();
+		if (seen[t]) continue;
+		seen[t] = true;
+		affected.push_back(normalize(target_names[t], prefix_dir, working_dir));
+		id_list const &l = reverse_dependencies[t];
+		todo.insert(todo.end(), l.begin(), l.end());
+		if (dependencies[t].empty()) continue;
+		id_list const &siblings = dependencies[t]->targets;
+		todo.insert(todo.end(), siblings.begin(), siblings.end());
+	}
+	affected.sort();
+	for (string_list::const_iterator i = affected.begin(),
+	     i_end = affected.end(); i != i_end; ++i)
+	{
+		std::cout << *i << '\n';
+	}
+	exit(EXIT_SUCCESS);
+}
+
+#ifndef WINDOWS
+#ifdef LINUX
+/**
+ * Inotify descriptor used by the daemon to track changes to the files of
+ * targets, or -1 if the status of all the targets is reset before each
+ * request.
+ */
+static int inotify_fd = -1;
+
+/**
+ * Directories watched through #inotify_fd, indexed by watch descriptor.
+ */
+static std::map<int, std::string> watched_dirs;
+
+/**
+ * Watch descriptors of the directories watched through #inotify_fd.
+ */
+static std::map<std::string, int> dir_watches;
+
+/**
+ * Number of targets whose directory has already been considered for
+ * watching. Later targets are handled by #watch_targets.
+ */
+static size_t nb_seen_targets = 0;
+
+/**
+ * Targets whose directory could not be watched yet.
+ */
+static id_list unwatched_targets;
+
+/**
+ * Targets whose file changed since the last request.
+ */
+static id_list changed_targets;
+
+/**
+ * Whether some changes might have been missed, e.g. because the event
+ * queue overflowed, so that the status of all the targets has to be reset.
+ */
+static bool changes_lost = true;
+
+/**
+ * Stop tracking changes.
  */
-static void accept_client()
+static void disable_inotify()
 {
-	DEBUG_open << "Handling client request... ";
+	DEBUG << "disabling file change tracking\n";
+	unwatch_fd(inotify_fd);
+	close(inotify_fd);
+	inotify_fd = -1;
+	watched_dirs.clear();
+	dir_watches.clear();
+}
 
-	// Accept connection.
-#ifdef WINDOWS
-	socket_t fd = accept(socket_fd, NULL, NULL);
-	if (fd == INVALID_SOCKET) return;
-	if (!SetHandleInformation((HANDLE)fd, HANDLE_FLAG_INHERIT, 0))
+/**
+ * Watch the directory containing target @a t.
+ * @return false if the directory could not be watched.
+ */
+static bool watch_target(target_id t)
+{
+	std::string const &name = target_names[t];
+	size_t pos = name.rfind('/');
+	std::string dir = pos == std::string::npos ? "." :
+		pos == 0 ? "/" : name.substr(0, pos);
+	if (dir_watches.count(dir)) return true;
+	int wd = inotify_add_watch(inotify_fd, dir.c_str(),
+		IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_MODIFY |
+		IN_MOVED_FROM | IN_MOVED_TO | IN_DELETE_SELF | IN_MOVE_SELF);
+	if (wd < 0)
 	{
-		error2:
-		std::cerr << "Unexpected failure while setting connection with client" << std::endl;
-		closesocket(fd);
-		return;
+		if (errno != ENOENT && errno != ENOTDIR) disable_inotify();
+		return false;
 	}
-	// WSAEventSelect puts sockets into nonblocking mode, so disable it here.
-	u_long nbio = 0;
-	if (ioctlsocket(fd, FIONBIO, &nbio)) goto error2;
-#elif defined(LINUX)
-	int fd = accept4(socket_fd, NULL, NULL, SOCK_CLOEXEC);
-	if (fd < 0) return;
-#else
-	int fd = accept(socket_fd, NULL, NULL);
-	if (fd < 0) return;
-	if (fcntl(fd, F_SETFD, FD_CLOEXEC) < 0) return;
-#endif
-	clients.push_front(client_t());
-	client_list::iterator proc = clients.begin();
+	watched_dirs[wd] = dir;
+	dir_watches[dir] = wd;
+	return true;
+}
 
-	if (false)
+/**
+ * Watch the directories of the targets created since the last call, and
+ * retry those that could not be watched. Since their status might have
+ * been computed before their directory was watched, they are considered
+ * changed.
+ */
+static void watch_targets()
+{
+	if (inotify_fd < 0) return;
+	id_list unwatched;
+	for (id_list::const_iterator i = unwatched_targets.begin(),
+	     i_end = unwatched_targets.end(); inotify_fd >= 0 && i != i_end; ++i)
 	{
-		error:
-		DEBUG_close << "failed\n";
-		std::cerr << "Received an ill-formed client message" << std::endl;
-	#ifdef WINDOWS
-		closesocket(fd);
-	#else
-		close(fd);
-	#endif
-		clients.erase(proc);
-		return;
+		if (!watch_target(*i)) unwatched.push_back(*i);
+		changed_targets.push_back(*i);
 	}
-
-	// Receive message. Stop when encountering two nuls in a row.
-	std::vector<char> buf;
-	size_t len = 0;
-	while (len < sizeof(int) + 2 || buf[len - 1] || buf[len - 2])
+	for (; inotify_fd >= 0 && nb_seen_targets < target_names.size(); ++nb_seen_targets)
 	{
-		buf.resize(len + 1024);
-		ssize_t l = recv(fd, &buf[0] + len, 1024, 0);
-		if (l <= 0) goto error;
-		len += l;
+		if (!watch_target(nb_seen_targets)) unwatched.push_back(nb_seen_targets);
+		changed_targets.push_back(nb_seen_targets);
 	}
+	unwatched_targets.swap(unwatched);
+}
 
-	// Parse job that spawned the client.
-	int job_id;
-	memcpy(&job_id, &buf[0], sizeof(int));
-	proc->socket = fd;
-	proc->job_id = job_id;
-	job_map::const_iterator i = jobs.find(job_id);
-	if (i == jobs.end()) goto error;
-	DEBUG << "receiving request from job " << job_id << std::endl;
-	if (propagate_vars) proc->vars = i->second.vars;
-
-	// Parse the targets and the variable assignments.
-	// Mark the targets as dependencies of the job targets.
-	dependency_t &dep = *dependencies[i->second.rule.targets.front()];
-	string_list *last_var = NULL;
-	char const *p = &buf[0] + sizeof(int);
-	while (true)
+/**
+ * Record the targets whose files changed, from the events of #inotify_fd.
+ */
+static void handle_inotify(int fd)
+{
+	char buf[4096] __attribute__((aligned(__alignof__(struct inotify_event))));
+	ssize_t len;
+	while ((len = read(fd, buf, sizeof(buf))) > 0)
 	{
-		len = strlen(p);
-		if (len == 0)
+		for (char *p = buf; p < buf + len;)
 		{
-			++waiting_jobs;
-			break;
-		}
-		switch (*p)
-		{
-		case 'T':
-		{
-			if (len == 1) goto error;
-			std::string target(p + 1, p + len);
-			DEBUG << "adding dependency " << target << " to job\n";
-			proc->pending.push_back(target);
-			dep.deps.insert(target);
-			break;
+			struct inotify_event const *ev = (struct inotify_event const *)p;
+			p += sizeof(struct inotify_event) + ev->len;
+			if (ev->mask & IN_Q_OVERFLOW)
+			{
+				changes_lost = true;
+				continue;
+			}
+			std::map<int, std::string>::iterator i = watched_dirs.find(ev->wd);
+			if (i == watched_dirs.end()) continue;
+			if (ev->mask & IN_IGNORED)
+			{
+				// The directory is gone; watch it again when possible.
+				changes_lost = true;
+				nb_seen_targets = 0;
+				dir_watches.erase(i->second);
+				watched_dirs.erase(i);
+				continue;
+			}
+			if (!ev->len) continue;
+			std::string name = ev->name;
+			if (i->second != ".") name = (i->second == "/" ? "" : i->second) + '/' + name;
+			target_id t = find_target(name);
+			if (t >= 0) changed_targets.push_back(t);
 		}
-		case 'V':
+	}
+}
+#endif
+
+/**
+ * Prepare #status for a new request of the daemon. If file changes are
+ * tracked, only the targets whose file changed, the targets that were not
+ * up-to-date, and the targets depending on them are reset. Otherwise, the
+ * status of all the targets is reset.
+ */
+static void invalidate_status()
+{
+	DEBUG_open << "Invalidating status... ";
+#ifdef LINUX
+	watch_targets();
+	if (inotify_fd >= 0 && !changes_lost)
+	{
+		id_list todo;
+		todo.swap(changed_targets);
+		for (size_t t = 0, t_end = status.size(); t != t_end; ++t)
 		{
-			if (len == 1) goto error;
-			std::string var(p + 1, p + len);
-			DEBUG << "adding variable " << var << " to job\n";
-			last_var = &proc->vars[var];
-			last_var->clear();
-			break;
+			status_e st = status[t].status;
+			if (st != Unknown && st != Uptodate) todo.push_back(t);
 		}
-		case 'W':
+		std::vector<char> seen(target_names.size());
+		size_t nb = 0;
+		while (!todo.empty())
 		{
-			if (!last_var) goto error;
-			last_var->push_back(std::string(p + 1, p + len));
-			break;
+			target_id t = todo.back();
+			todo.pop_back();
+			if (seen[t]) continue;
+			seen[t] = true;
+			++nb;
+			status[t] = status_t();
+			id_list const &l = reverse_dependencies[t];
+			todo.insert(todo.end(), l.begin(), l.end());
+			if (dependencies[t].empty()) continue;
+			id_list const &siblings = dependencies[t]->targets;
+			todo.insert(todo.end(), siblings.begin(), siblings.end());
 		}
-		default:
-			goto error;
-		}
-		p += len + 1;
+		DEBUG_close << nb << " targets\n";
 	}
-
-	if (!propagate_vars && !proc->vars.empty())
+	else
+#endif
 	{
-		std::cerr << "Assignments are ignored unless 'variable-propagation' is enabled" << std::endl;
-		proc->vars.clear();
+		DEBUG_close << "all targets\n";
+		status.assign(status.size(), status_t());
+	}
+#ifdef LINUX
+	changed_targets.clear();
+	changes_lost = false;
+#endif
+	for (id_list::const_iterator i = phony_targets.begin(),
+	     i_end = phony_targets.end(); i != i_end; ++i)
+	{
+		status[*i].status = Todo;
 	}
 }
 
 /**
- * Handle child process exit status.
- */
-static void finalize_job(pid_t pid, bool res)
-{
-	pid_job_map::iterator i = job_pids.find(pid);
-	assert(i != job_pids.end());
-	int job_id = i->second;
-	job_pids.erase(i);
-	--running_jobs;
-	complete_job(job_id, res);
-}
-
-/**
- * Loop until all the jobs have finished.
- *
- * @post There are no client requests left, not even virtual ones.
+ * Serve the top-level request @a req: redirect the output of the daemon
+ * and of the jobs to the descriptors of the client, apply its options
+ * instead of those of the daemon, build its targets, and send it the
+ * result.
  */
-static void server_loop()
+static void serve_request(std::string const &remakefile, connection_t &req)
 {
-	while (handle_clients())
+	DEBUG_open << "Serving top-level request... ";
+	std::cout.flush();
+	int saved_fds[2] = { dup(1), dup(2) };
+	if (req.fds.size() == 2)
 	{
-		DEBUG_open << "Handling events... ";
-	#ifdef WINDOWS
-		size_t len = job_pids.size() + 1;
-		HANDLE h[len];
-		int num = 0;
-		for (pid_job_map::const_iterator i = job_pids.begin(),
-		     i_end = job_pids.end(); i != i_end; ++i, ++num)
-		{
-			h[num] = i->first;
-		}
-		WSAEVENT aev = WSACreateEvent();
-		h[num] = aev;
-		WSAEventSelect(socket_fd, aev, FD_ACCEPT);
-		DWORD w = WaitForMultipleObjects(len, h, false, INFINITE);
-		WSAEventSelect(socket_fd, aev, 0);
-		WSACloseEvent(aev);
-		if (len <= w)
-			continue;
-		if (w == len - 1)
+		dup2(req.fds[0], 1);
+		dup2(req.fds[1], 2);
+	}
+	bool saved_keep_going = keep_going, saved_show_targets = show_targets,
+		saved_echo_scripts = echo_scripts, saved_obsolete_targets = obsolete_targets,
+		saved_sync_output = sync_output;
+	int saved_max_active_jobs = max_active_jobs;
+	double saved_max_load = max_load;
+	long saved_memory_headroom = memory_headroom;
+	keep_going = false;
+	show_targets = true;
+	echo_scripts = false;
+	obsolete_targets = false;
+	sync_output = false;
+	max_active_jobs = 1;
+	max_load = 0;
+	memory_headroom = 0;
+	for (string_list::const_iterator i = req.options.begin(),
+	     i_end = req.options.end(); i != i_end; ++i)
+	{
+		switch ((*i)[0])
 		{
-			accept_client();
-			continue;
-		}
-		pid_t pid = h[w];
-		DWORD s = 0;
-		bool res = GetExitCodeProcess(pid, &s) && s == 0;
-		CloseHandle(pid);
-		finalize_job(pid, res);
-	#else
-		sigset_t emptymask;
-		sigemptyset(&emptymask);
-		fd_set fdset;
-		FD_ZERO(&fdset);
-		FD_SET(socket_fd, &fdset);
-		int ret = pselect(socket_fd + 1, &fdset, NULL, NULL, NULL, &emptymask);
-		if (ret > 0 /* && FD_ISSET(socket_fd, &fdset)*/) accept_client();
-		if (!got_SIGCHLD) continue;
-		got_SIGCHLD = 0;
-		pid_t pid;
-		int status;
-		while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
-		{
-			bool res = WIFEXITED(status) && WEXITSTATUS(status) == 0;
-			finalize_job(pid, res);
+		case 'k': keep_going = true; break;
+		case 's': show_targets = false; break;
+		case 'd': echo_scripts = true; break;
+		case 'B': obsolete_targets = true; break;
+		case 'O': sync_output = true; break;
+		case 'j': max_active_jobs = atoi(i->c_str() + 1); break;
+		case 'l': max_load = atof(i->c_str() + 1); break;
+		case 'm': memory_headroom = atol(i->c_str() + 1); break;
 		}
-	#endif
 	}
 
-	assert(clients.empty());
+	// Files might have changed since the last request.
+	now = current_time();
+	invalidate_status();
+	prefetched.clear();
+	build_failure = false;
+	build(remakefile, req.client.pending);
+	save_dependencies();
+
+	keep_going = saved_keep_going && !got_SIGTERM;
+	show_targets = saved_show_targets;
+	echo_scripts = saved_echo_scripts;
+	obsolete_targets = saved_obsolete_targets;
+	sync_output = saved_sync_output;
+	max_active_jobs = saved_max_active_jobs;
+	max_load = saved_max_load;
+	memory_headroom = saved_memory_headroom;
+	std::cout.flush();
+	dup2(saved_fds[0], 1);
+	dup2(saved_fds[1], 2);
+	close(saved_fds[0]);
+	close(saved_fds[1]);
+	for (std::vector<int>::const_iterator i = req.fds.begin(),
+	     i_end = req.fds.end(); i != i_end; ++i)
+	{
+		close(*i);
+	}
+	char res = build_failure ? 0 : 1;
+	send(req.client.socket, &res, 1, MSG_NOSIGNAL);
+	close(req.client.socket);
 }
 
 /**
- * Load dependencies and rules, listen to client requests, and loop until
- * all the requests have completed.
- * If Remakefile is obsolete, perform a first run with it only, then reload
- * the rules, and perform a second with the original clients.
+ * Load dependencies and rules, then serve top-level requests from other
+ * remake processes until SIGTERM or SIGINT is received. The rules, the
+ * dependencies, and the status of targets stay in memory between
+ * requests. The rules are reloaded whenever @a remakefile changes.
+ *
+ * The name of the server socket is written to <tt>.remake.daemon</tt>, so
+ * that top-level remake processes started in the same directory send
+ * their requests to the daemon rather than building by themselves.
  */
-static void server_mode(std::string const &remakefile, string_list const &targets)
+static void daemon_mode(std::string const &remakefile)
 {
 	load_dependencies();
 	load_rules(remakefile);
+	struct stat s, rules_stat;
+	if (stat(remakefile.c_str(), &rules_stat))
+		memset(&rules_stat, 0, sizeof(rules_stat));
+
+	// Termination signals are only received while waiting for events.
+	sigset_t sigmask;
+	sigemptyset(&sigmask);
+	sigaddset(&sigmask, SIGINT);
+	sigaddset(&sigmask, SIGTERM);
+	sigprocmask(SIG_BLOCK, &sigmask, NULL);
 	create_server();
-	if (get_status(remakefile).status != Uptodate)
+	struct sigaction sa;
+	sa.sa_flags = 0;
+	sigemptyset(&sa.sa_mask);
+	sa.sa_handler = &sigterm_handler;
+	sigaction(SIGINT, &sa, NULL);
+	sigaction(SIGTERM, &sa, NULL);
+	setup_events();
+#ifdef LINUX
+	inotify_fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if (inotify_fd >= 0) watch_fd(inotify_fd, &handle_inotify);
+#endif
 	{
-		clients.push_back(client_t());
-		clients.back().pending.push_back(remakefile);
-		server_loop();
-		if (build_failure) goto early_exit;
-		variables.clear();
-		specific_rules.clear();
-		generic_rules.clear();
-		first_target.clear();
-		load_rules(remakefile);
+		std::ofstream out(".remake.daemon");
+		out << socket_name << std::endl;
+		if (!out.good())
+		{
+			std::cerr << "Failed to create .remake.daemon" << std::endl;
+			exit(EXIT_FAILURE);
+		}
 	}
-	clients.push_back(client_t());
-	if (!targets.empty()) clients.back().pending = targets;
-	else if (!first_target.empty())
-		clients.back().pending.push_back(first_target);
-	server_loop();
-	early_exit:
+
+	while (!got_SIGTERM)
+	{
+		if (daemon_requests.empty())
+		{
+			handle_events();
+			continue;
+		}
+		connection_t req = daemon_requests.front();
+		daemon_requests.pop_front();
+		if (stat(remakefile.c_str(), &s) == 0 &&
+		    (get_file_time(s) != get_file_time(rules_stat) || s.st_size != rules_stat.st_size ||
+		     s.st_ino != rules_stat.st_ino))
+		{
+			DEBUG << "reloading rules\n";
+			rules_stat = s;
+			reload_rules(remakefile);
+			status.assign(status.size(), status_t());
+		}
+		serve_request(remakefile, req);
+	}
+
+	remove(".remake.daemon");
 	close(socket_fd);
-#ifndef WINDOWS
 	remove(socket_name);
 	free(socket_name);
-#endif
 	save_dependencies();
-	if (show_targets && changed_prefix_dir)
-	{
-		std::cout << "remake: Leaving directory `" << prefix_dir << '\'' << std::endl;
-	}
-	exit(build_failure ? EXIT_FAILURE : EXIT_SUCCESS);
+	close_trace();
+	exit(EXIT_SUCCESS);
 }
+#endif
 
 /** @} */
 
@@ -2861,46 +6447,58 @@ static void server_mode(std::string const &remakefile, string_list const &target
  */
 
 /**
- * Connect to the server @a socket_name, send a request for building @a targets
- * with some @a variables, and exit with the status returned by the server.
+ * Connect #socket_fd to the server listening on @a socket_name.
+ * @return false on failure.
  */
-static void client_mode(char *socket_name, string_list const &targets)
+static bool connect_server(char const *socket_name)
 {
-	if (false)
-	{
-		error:
-		perror("Failed to send targets to server");
-		exit(EXIT_FAILURE);
-	}
-	if (targets.empty()) exit(EXIT_SUCCESS);
 	DEBUG_open << "Connecting to server... ";
-
-	// Connect to server.
 #ifdef WINDOWS
 	struct sockaddr_in socket_addr;
 	socket_fd = socket(AF_INET, SOCK_STREAM, 0);
-	if (socket_fd == INVALID_SOCKET) goto error;
+	if (socket_fd == INVALID_SOCKET) return false;
 	socket_addr.sin_family = AF_INET;
 	socket_addr.sin_addr.s_addr = inet_addr("127.0.0.1");
 	socket_addr.sin_port = atoi(socket_name);
 	if (connect(socket_fd, (struct sockaddr *)&socket_addr, sizeof(sockaddr_in)))
-		goto error;
+		return false;
 #else
 	struct sockaddr_un socket_addr;
 	size_t len = strlen(socket_name);
-	if (len >= sizeof(socket_addr.sun_path) - 1) exit(EXIT_FAILURE);
+	if (len >= sizeof(socket_addr.sun_path) - 1) return false;
 	socket_fd = socket(AF_UNIX, SOCK_STREAM, 0);
-	if (socket_fd == INVALID_SOCKET) goto error;
+	if (socket_fd == INVALID_SOCKET) return false;
 	socket_addr.sun_family = AF_UNIX;
 	strcpy(socket_addr.sun_path, socket_name);
 	if (connect(socket_fd, (struct sockaddr *)&socket_addr, sizeof(socket_addr.sun_family) + len))
-		goto error;
+	{
+		close(socket_fd);
+		return false;
+	}
 #ifdef MACOSX
 	int set_option = 1;
 	if (setsockopt(socket_fd, SOL_SOCKET, SO_NOSIGPIPE, &set_option, sizeof(set_option)))
-		goto error;
+		return false;
 #endif
 #endif
+	return true;
+}
+
+/**
+ * Send a request for building @a targets with some #variables to the server
+ * @a socket_name, using #connect_server, and exit with the status returned
+ * by the server.
+ */
+static void client_mode(char *socket_name, string_list const &targets)
+{
+	if (false)
+	{
+		error:
+		perror("Failed to send targets to server");
+		exit(EXIT_FAILURE);
+	}
+	if (targets.empty()) exit(EXIT_SUCCESS);
+	if (!connect_server(socket_name)) goto error;
 
 	// Send current job id.
 	char *id = getenv("REMAKE_JOB_ID");
@@ -2945,6 +6543,89 @@ static void client_mode(char *socket_name, string_list const &targets)
 	exit(result ? EXIT_SUCCESS : EXIT_FAILURE);
 }
 
+#ifndef WINDOWS
+/**
+ * Connect #socket_fd to the daemon serving the current directory.
+ * @return false if there is no daemon running.
+ */
+static bool connect_daemon()
+{
+	std::ifstream in(".remake.daemon");
+	std::string socket_name;
+	return std::getline(in, socket_name) && connect_server(socket_name.c_str());
+}
+
+/**
+ * Send @a targets and @a options to the daemon serving the current
+ * directory, if any, along with the standard output and error. Then wait
+ * for the reply and exit with it. If @a local_option is set, it names an
+ * option that the daemon cannot honor, and the request is refused.
+ * @return only if there is no daemon running.
+ */
+static void daemon_client(string_list const &targets, string_list const &options,
+	char const *local_option)
+{
+	if (!connect_daemon()) return;
+	if (false)
+	{
+		error:
+		perror("Failed to send targets to daemon");
+		exit(EXIT_FAILURE);
+	}
+	if (!variables.empty())
+	{
+		std::cerr << "Variables cannot be assigned when a daemon is running" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+	if (local_option)
+	{
+		std::cerr << "Option " << local_option << " cannot be used when a daemon is running" << std::endl;
+		exit(EXIT_FAILURE);
+	}
+
+	// Send a negative job id, along with the output descriptors.
+	int job_id = -1;
+	struct iovec iov = { &job_id, sizeof(job_id) };
+	char cbuf[CMSG_SPACE(2 * sizeof(int))];
+	memset(cbuf, 0, sizeof(cbuf));
+	struct msghdr msg;
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = cbuf;
+	msg.msg_controllen = sizeof(cbuf);
+	struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+	c->cmsg_level = SOL_SOCKET;
+	c->cmsg_type = SCM_RIGHTS;
+	c->cmsg_len = CMSG_LEN(2 * sizeof(int));
+	int fds[2] = { 1, 2 };
+	memcpy(CMSG_DATA(c), fds, sizeof(fds));
+	if (sendmsg(socket_fd, &msg, MSG_NOSIGNAL) != sizeof(job_id)) goto error;
+
+	// Send targets and options.
+	std::string s;
+	for (string_list::const_iterator i = targets.begin(),
+	     i_end = targets.end(); i != i_end; ++i)
+	{
+		s += 'T' + *i;
+		s += '\0';
+	}
+	for (string_list::const_iterator i = options.begin(),
+	     i_end = options.end(); i != i_end; ++i)
+	{
+		s += 'O' + *i;
+		s += '\0';
+	}
+	s += '\0';
+	if (send(socket_fd, s.c_str(), s.length(), MSG_NOSIGNAL) != (ssize_t)s.length())
+		goto error;
+
+	char result = 0;
+	if (recv(socket_fd, &result, 1, 0) != 1) exit(EXIT_FAILURE);
+	exit(result ? EXIT_SUCCESS : EXIT_FAILURE);
+}
+#endif
+
 /** @} */
 
 /**
@@ -2960,15 +6641,22 @@ static void usage(int exit_status)
 {
 	std::cerr << "Usage: remake [options] [target] ...\n"
 		"Options\n"
+		"  --affected             Print the targets depending on the given files.\n"
 		"  -B, --always-make      Unconditionally make all targets.\n"
+		"  --daemon               Keep serving build requests from this directory.\n"
 		"  -d                     Echo script commands.\n"
 		"  -d -d                  Print lots of debugging information.\n"
 		"  -f FILE                Read FILE as Remakefile.\n"
 		"  -h, --help             Print this message and exit.\n"
 		"  -j[N], --jobs=[N]      Allow N jobs at once; infinite jobs with no arg.\n"
 		"  -k, --keep-going       Keep going when some targets cannot be made.\n"
+		"  -l[N], --load-average=[N]  Do not start jobs while the load is above N.\n"
+		"  --memory-headroom=N    Do not start jobs while less than N megabytes of\n"
+		"                         memory are available.\n"
+		"  -O, --output-sync      Display the output of each script at once.\n"
 		"  -r                     Look up targets from the dependencies on stdin.\n"
-		"  -s, --silent, --quiet  Do not echo targets.\n";
+		"  -s, --silent, --quiet  Do not echo targets.\n"
+		"  --trace=FILE           Write a timeline of the build to FILE.\n";
 	exit(exit_status);
 }
 
@@ -2987,8 +6675,13 @@ int main(int argc, char *argv[])
 {
 	std::string remakefile;
 	string_list targets;
+	string_list daemon_options;
 	bool literal_targets = false;
 	bool indirect_targets = false;
+	bool affected_targets = false;
+	bool jobs_given = false;
+	std::string trace_name;
+	now = current_time();
 
 	// Parse command-line arguments.
 	for (int i = 1; i < argc; ++i)
@@ -2998,16 +6691,33 @@ int main(int argc, char *argv[])
 		if (literal_targets) goto new_target;
 		if (arg == "-h" || arg == "--help") usage(EXIT_SUCCESS);
 		if (arg == "-d")
+		{
 			if (echo_scripts) debug.active = true;
 			else echo_scripts = true;
+			daemon_options.push_back("d");
+		}
 		else if (arg == "-k" || arg =="--keep-going")
+		{
 			keep_going = true;
+			daemon_options.push_back("k");
+		}
 		else if (arg == "-s" || arg == "--silent" || arg == "--quiet")
+		{
 			show_targets = false;
+			daemon_options.push_back("s");
+		}
+		else if (arg == "-O" || arg == "--output-sync")
+		{
+			sync_output = true;
+			daemon_options.push_back("O");
+		}
 		else if (arg == "-r")
 			indirect_targets = true;
 		else if (arg == "-B" || arg == "--always-make")
+		{
 			obsolete_targets = true;
+			daemon_options.push_back("B");
+		}
 		else if (arg == "-f")
 		{
 			if (++i == argc) usage(EXIT_FAILURE);
@@ -3015,10 +6725,34 @@ int main(int argc, char *argv[])
 		}
 		else if (arg == "--")
 			literal_targets = true;
-		else if (arg.compare(0, 2, "-j") == 0)
-			max_active_jobs = atoi(arg.c_str() + 2);
-		else if (arg.compare(0, 7, "--jobs=") == 0)
-			max_active_jobs = atoi(arg.c_str() + 7);
+		else if (arg == "--daemon")
+			daemon_server = true;
+		else if (arg == "--affected")
+			affected_targets = true;
+		else if (arg.compare(0, 8, "--trace=") == 0)
+			trace_name = arg.substr(8);
+		else if (arg.compare(0, 2, "-j") == 0 || arg.compare(0, 7, "--jobs=") == 0)
+		{
+			max_active_jobs = atoi(arg.c_str() + (arg[1] == 'j' ? 2 : 7));
+			jobs_given = true;
+			std::ostringstream buf;
+			buf << 'j' << max_active_jobs;
+			daemon_options.push_back(buf.str());
+		}
+		else if (arg.compare(0, 2, "-l") == 0 || arg.compare(0, 15, "--load-average=") == 0)
+		{
+			max_load = atof(arg.c_str() + (arg[1] == 'l' ? 2 : 15));
+			std::ostringstream buf;
+			buf << 'l' << max_load;
+			daemon_options.push_back(buf.str());
+		}
+		else if (arg.compare(0, 18, "--memory-headroom=") == 0)
+		{
+			memory_headroom = atol(arg.c_str() + 18);
+			std::ostringstream buf;
+			buf << 'm' << memory_headroom;
+			daemon_options.push_back(buf.str());
+		}
 		else
 		{
 			if (arg[0] == '-') usage(EXIT_FAILURE);
@@ -3041,26 +6775,47 @@ int main(int argc, char *argv[])
 
 	if (indirect_targets)
 	{
-		load_dependencies(std::cin);
+		std::ostringstream input;
+		input << std::cin.rdbuf();
+		std::string const &data = input.str();
+		memory_stream in(data.data(), data.data() + data.size());
+		load_dependencies(in);
 		string_list l;
 		targets.swap(l);
-		if (l.empty() && !dependencies.empty())
+		// Identifiers follow the order of appearance, so names are sorted
+		// to pick the default target and to list the prerequisites.
+		if (l.empty())
 		{
-			l.push_back(dependencies.begin()->second->targets.front());
+			target_id first = -1;
+			for (target_id t = 0, t_end = dependencies.size(); t != t_end; ++t)
+			{
+				if (dependencies[t].empty()) continue;
+				if (first < 0 || target_names[t] < target_names[first]) first = t;
+			}
+			if (first >= 0)
+				l.push_back(target_names[dependencies[first]->targets.front()]);
 		}
 		for (string_list::const_iterator i = l.begin(),
 		     i_end = l.end(); i != i_end; ++i)
 		{
-			dependency_map::const_iterator j = dependencies.find(*i);
-			if (j == dependencies.end()) continue;
-			dependency_t const &dep = *j->second;
-			for (string_set::const_iterator k = dep.deps.begin(),
+			target_id t = find_target(*i);
+			if (t < 0 || dependencies[t].empty()) continue;
+			dependency_t const &dep = *dependencies[t];
+			string_list deps;
+			for (id_list::const_iterator k = dep.deps.begin(),
 			     k_end = dep.deps.end(); k != k_end; ++k)
+			{
+				deps.push_back(target_names[*k]);
+			}
+			deps.sort();
+			for (string_list::const_iterator k = deps.begin(),
+			     k_end = deps.end(); k != k_end; ++k)
 			{
 				targets.push_back(normalize(*k, working_dir, working_dir));
 			}
 		}
-		dependencies.clear();
+		dependencies.assign(dependencies.size(), ref_ptr<dependency_t>());
+		reverse_dependencies.assign(reverse_dependencies.size(), id_list());
 	}
 
 #ifdef WINDOWS
@@ -3076,13 +6831,35 @@ int main(int argc, char *argv[])
 	if (char *sn = getenv("REMAKE_SOCKET")) client_mode(sn, targets);
 
 	// Otherwise run as server.
+	bool remakefile_given = !remakefile.empty();
 	if (remakefile.empty())
 	{
 		remakefile = "Remakefile";
 		init_prefix_dir();
 	}
 	normalize_list(targets, working_dir, prefix_dir);
+	if (affected_targets) affected_mode(remakefile, targets);
+#ifndef WINDOWS
+	if (daemon_server)
+	{
+		if (!targets.empty()) usage(EXIT_FAILURE);
+		if (connect_daemon())
+		{
+			std::cerr << "A daemon is already running in this directory" << std::endl;
+			exit(EXIT_FAILURE);
+		}
+		if (!trace_name.empty()) open_trace(trace_name);
+		daemon_mode(remakefile);
+	}
+	char const *local_option = NULL;
+	if (remakefile_given) local_option = "-f";
+	if (!trace_name.empty()) local_option = "--trace";
+	daemon_client(targets, daemon_options, local_option);
+	init_jobserver(jobs_given);
+#endif
+	if (!trace_name.empty()) open_trace(trace_name);
 	server_mode(remakefile, targets);
+	return EXIT_SUCCESS;
 }
 
 /** @} */
@@ -0,0 +1,24 @@
+#!/bin/sh
+
+# Check that a database in the former textual format is still understood.
+
+cat > Remakefile <<EOF
+a: b
+	cat b > a
+	echo a\$\$TICK >> a
+b:
+	echo b > b
+EOF
+
+echo b > b
+echo c > c
+echo a0 > a
+touch -d "1 day ago" a b
+printf 'a : b c\n' > .remake
+
+export TICK=1
+$REMAKE
+grep -q a1 a
+TICK=2
+$REMAKE
+grep -q a1 a
@@ -0,0 +1,27 @@
+#!/bin/sh
+
+# Check that dynamic dependencies survive an interrupted run.
+
+cat > Remakefile <<EOF
+a:
+	$REMAKE b
+	echo a\$\$TICK > a
+	if test -n "\$\$KILL"; then kill -9 \$\$PPID; fi
+b:
+	echo b > b
+EOF
+
+export TICK=1 KILL=1
+$REMAKE || true
+grep -q a1 a
+touch -d "1 day ago" a
+TICK=2 KILL=
+$REMAKE
+grep -q a2 a
+
+# A journal whose header was cut off is discarded, not a foreign one.
+printf 'REMAKEJL\003' > .remake.journal
+$REMAKE
+grep -q a2 a
+echo garbage > .remake.journal
+! $REMAKE
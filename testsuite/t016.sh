@@ -0,0 +1,15 @@
+#!/bin/sh
+
+# Check that large scripts are delivered whole to the shell.
+
+echo "a:" > Remakefile
+i=0
+while test $i -lt 5000; do
+	printf '\techo line%s >> a\n' $i >> Remakefile
+	i=$((i + 1))
+done
+printf '\techo done >> a\n' >> Remakefile
+
+$REMAKE
+test $(wc -l < a) -eq 5001
+tail -n 1 a | grep -q done
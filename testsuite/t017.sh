@@ -0,0 +1,18 @@
+#!/bin/sh
+
+# Check that large requests from several jobs at once are received whole.
+
+cat > Remakefile <<EOF
+all: la lb
+	cat la lb > all
+
+l%:
+	$REMAKE \`i=0; while test \$\$i -lt 500; do echo \$*-with-a-rather-long-name-\$\$i; i=\$\$((i + 1)); done\`
+	ls \$*-with-* | wc -l > \$@
+
+%:
+	touch \$@
+EOF
+
+$REMAKE -j4
+test "$(tr -d ' \n' < all)" = 500500
@@ -0,0 +1,51 @@
+#!/bin/sh
+
+# Check that a daemon serves top-level requests and notices rule changes.
+
+cat > Remakefile <<EOF
+a: b
+	cat b > a
+	echo \$\$PPID >> a
+
+b:
+	echo b1 > b
+
+c:
+	echo hello
+
+fail:
+	false
+EOF
+
+$REMAKE --daemon &
+i=0
+while ! test -f .remake.daemon; do
+	i=$((i + 1))
+	test $i -lt 100
+	sleep 0.1
+done
+
+$REMAKE a
+grep -q b1 a
+$REMAKE c > out
+grep -q hello out
+! $REMAKE fail
+
+# The scripts run in the daemon, not in the client.
+test $(sed -n 2p a) -eq $!
+
+cat > Remakefile <<EOF
+d:
+	echo d > d
+EOF
+$REMAKE d
+test -f d
+
+# Options that the daemon would not honor are refused.
+! $REMAKE -f Remakefile d
+! $REMAKE --trace=trace.json d
+test ! -f trace.json
+
+kill $!
+wait $! || true
+test ! -f .remake.daemon
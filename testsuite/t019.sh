@@ -0,0 +1,45 @@
+#!/bin/sh
+
+# Check that a daemon notices file changes between requests.
+
+cat > Remakefile <<EOF
+.PHONY: p
+
+c: a
+	cat a > c
+	echo c >> c
+
+a: b
+	cat b > a
+
+p:
+	echo p >> p
+EOF
+
+echo b1 > b
+touch -d "2 days ago" b
+
+$REMAKE --daemon &
+i=0
+while ! test -f .remake.daemon; do
+	i=$((i + 1))
+	test $i -lt 100
+	sleep 0.1
+done
+
+$REMAKE c p
+$REMAKE c p
+test $(wc -l < c) -eq 2
+test $(wc -l < p) -eq 2
+
+echo b2 > b
+touch -d "1 hour" b
+$REMAKE c
+grep -q b2 c
+
+rm a
+$REMAKE c
+test -f a
+
+kill $!
+wait $! || true
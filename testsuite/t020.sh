@@ -0,0 +1,23 @@
+#!/bin/sh
+
+# Check that --affected follows static and dynamic dependencies backwards.
+
+cat > Remakefile <<EOF
+all: c d
+	touch all
+
+c: a
+	$REMAKE b
+	cat a b > c
+
+d:
+	touch d
+
+a b:
+	touch a b
+EOF
+
+$REMAKE
+test "$($REMAKE --affected b | tr '\n' ' ')" = "all c "
+test "$($REMAKE --affected d | tr '\n' ' ')" = "all "
+test -z "$($REMAKE --affected all)"
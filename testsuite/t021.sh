@@ -0,0 +1,32 @@
+#!/bin/sh
+
+# Check that the checksum option ignores dates and stops at unchanged files.
+
+cat > Remakefile <<EOF
+.OPTIONS = checksum
+
+c: b
+	cp b c
+	echo c >> log
+
+b: a
+	wc -l < a > b
+	echo b >> log
+EOF
+
+echo x > a
+touch -d "2 days ago" a
+$REMAKE c
+test $(wc -l < log) -eq 2
+
+touch a
+$REMAKE c
+test $(wc -l < log) -eq 2
+
+echo y > a
+$REMAKE c
+test $(wc -l < log) -eq 3
+
+printf 'y\nz\n' > a
+$REMAKE c
+test $(wc -l < log) -eq 5
@@ -0,0 +1,34 @@
+#!/bin/sh
+
+# Check that the cache option restores targets along with their dependencies.
+
+cat > Remakefile <<EOF
+.OPTIONS = cache
+
+o: s
+	$REMAKE h
+	cat s h > o
+	echo built >> log
+EOF
+
+echo 1 > s
+echo 1 > h
+$REMAKE o
+test $(wc -l < log) -eq 1
+
+echo 2 > s
+touch -d "1 hour" s
+$REMAKE o
+test $(wc -l < log) -eq 2
+
+echo 1 > s
+touch -d "2 hours" s
+$REMAKE o
+test $(wc -l < log) -eq 2
+test "$(cat o)" = "1
+1"
+
+rm o
+$REMAKE o
+test $(wc -l < log) -eq 2
+test "$($REMAKE --affected h)" = o
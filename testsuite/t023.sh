@@ -0,0 +1,21 @@
+#!/bin/sh
+
+# Check that parallel builds start the longest jobs first.
+
+cat > Remakefile <<EOF
+all: a.o b.o c.o
+	touch all
+
+%.o: s
+	if test \$@ = c.o; then echo \$@ >> order; sleep 1; else sleep 0.3; echo \$@ >> order; fi
+	touch \$@
+EOF
+
+touch s
+$REMAKE -j2
+test "$(head -n 1 order)" != c.o
+
+rm order
+touch -d "1 hour" s
+$REMAKE -j2
+test "$(head -n 1 order)" = c.o
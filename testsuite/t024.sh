@@ -0,0 +1,27 @@
+#!/bin/sh
+
+# Check that weighted jobs and memory shortage limit parallelism.
+
+cat > Remakefile <<EOF
+all: a b c
+
+a: .WEIGHT = 2
+
+%:
+	echo start \$@ >> log
+	sleep 0.2
+	echo end \$@ >> log
+EOF
+
+$REMAKE -j2
+test "$(head -n 2 log | tr '\n' ' ')" = "start a end a "
+
+rm log
+$REMAKE -j4 --memory-headroom=100000000 a b c
+# The jobs may run in any order, since they are prioritized by the
+# durations recorded by the first build, but not concurrently.
+if test -f /proc/meminfo; then
+	test $(wc -l < log) -eq 6
+	awk 'NR % 2 { if ($1 != "start") exit 1; t = $2; next }
+		$1 != "end" || $2 != t { exit 1 }' log
+fi
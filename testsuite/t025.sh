@@ -0,0 +1,32 @@
+#!/bin/sh
+
+# Check that remake shares its jobs with GNU make through a jobserver.
+
+cat > Remakefile <<EOF
+all: a b
+	echo "\$\$MAKEFLAGS" > all
+
+a:
+	touch a.start
+	i=0; while ! test -f b.start; do i=\$\$((i + 1)); test \$\$i -lt 50; sleep 0.1; done
+	touch a
+
+b:
+	touch b.start
+	i=0; while ! test -f a.start; do i=\$\$((i + 1)); test \$\$i -lt 50; sleep 0.1; done
+	touch b
+EOF
+
+$REMAKE -j2
+grep -q -- "--jobserver-auth=fifo:" all
+rm a b all a.start b.start
+
+# Both jobs can only succeed if they run at once, which needs a token from make.
+if which make > /dev/null; then
+	cat > Makefile <<EOF
+all:
+	+$REMAKE
+EOF
+	make -s -j2
+	test -f all
+fi
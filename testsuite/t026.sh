@@ -0,0 +1,18 @@
+#!/bin/sh
+
+# Check that the output of parallel scripts is not interleaved with -O.
+
+cat > Remakefile <<EOF
+all: a.o b.o
+
+%.o:
+	echo \$@ 1
+	sleep 0.5
+	echo \$@ 2 >&2
+	touch \$@
+EOF
+
+$REMAKE -j2 -O all > out 2>&1
+test "$(sed -n 1p out | cut -c1)" = "$(sed -n 2p out | cut -c1)"
+test "$(sed -n 3p out | cut -c1)" = "$(sed -n 4p out | cut -c1)"
+test $(wc -l < out) -eq 4
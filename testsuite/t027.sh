@@ -0,0 +1,23 @@
+#!/bin/sh
+
+# Check that --trace writes a timeline of the jobs and of the server.
+
+cat > Remakefile <<EOF
+a: b
+	$REMAKE c
+	cat b c > a
+
+b c:
+	echo b > b
+	echo c > c
+EOF
+
+$REMAKE --trace=trace.json a
+test "$(head -n 1 trace.json)" = "["
+test "$(tail -n 1 trace.json)" = "]"
+grep -q '"name":"load_rules","ph":"X"' trace.json
+grep -q '"name":"save_dependencies","ph":"X"' trace.json
+grep -q '"name":"check_status","ph":"X"' trace.json
+grep -q '"name":"script","ph":"b".*"targets":"b c"' trace.json
+grep -q '"name":"wait","ph":"e"' trace.json
+test $(grep -c '"ph":"b"' trace.json) -eq $(grep -c '"ph":"e"' trace.json)
@@ -0,0 +1,41 @@
+#!/bin/sh
+
+# Check that the rule cache follows Remakefile and command-line variables.
+
+cat > Remakefile <<EOF
+A = a1
+a:
+	echo \$(A) > a
+EOF
+
+$REMAKE a
+test -f .remake.rules
+grep -q a1 a
+
+# Same size and same date, different content.
+sed -i -e s/a1/a2/ Remakefile
+touch -d "1 hour ago" Remakefile
+rm a
+$REMAKE a
+grep -q a2 a
+
+rm a
+$REMAKE a A=b3
+grep -q a2 a
+
+cat > Remakefile <<EOF
+a:
+	echo \$(A) > a
+EOF
+rm a
+$REMAKE a A=b3
+grep -q b3 a
+rm a
+$REMAKE a A=b4
+grep -q b4 a
+
+# A damaged cache is ignored.
+echo garbage > .remake.rules
+rm a
+$REMAKE a A=b5
+grep -q b5 a
@@ -0,0 +1,41 @@
+#!/bin/sh
+
+# Check that propagated variables accumulate along nested calls without
+# leaking into siblings.
+
+cat > Remakefile <<EOF
+.OPTIONS = variable-propagation
+VAR = 0
+
+a.top: VAR += a
+b.mid: VAR += b
+b.mid: d.leaf
+e.leaf: VAR += e
+
+%.top:
+	$REMAKE b.mid
+	$REMAKE VAR=x c.call
+	echo \$(VAR) > \$@
+
+%.mid:
+	echo \$(VAR) > \$@
+
+%.call:
+	$REMAKE e.leaf
+	echo \$(VAR) > \$@
+
+%.leaf:
+	echo \$(VAR) > \$@
+EOF
+
+$REMAKE a.top
+
+cat > z <<EOF
+0 a
+0 a b
+0 a b
+x
+x e
+EOF
+
+cat a.top b.mid d.leaf c.call e.leaf | cmp - z
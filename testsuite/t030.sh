@@ -0,0 +1,30 @@
+#!/bin/sh
+
+# Check that targets restored from the cache cause their users to be rebuilt.
+
+cat > Remakefile <<EOF
+.OPTIONS = cache
+
+b: a
+	cp a b
+
+c: b
+	cp b c
+EOF
+
+echo 1 > a
+$REMAKE c
+
+echo 2 > a
+touch -d "1 hour" a
+$REMAKE c
+test "$(cat c)" = 2
+# Age the targets, so that their restoration is noticed by their dates.
+touch -d "2 hours ago" b
+touch -d "1 hour ago" c
+
+echo 1 > a
+touch -d "2 hours" a
+$REMAKE c
+test "$(cat b)" = 1
+test "$(cat c)" = 1
@@ -0,0 +1,16 @@
+#!/bin/sh
+
+# Check that option -r picks the first entry by name and builds its
+# prerequisites in the order of their names.
+
+cat > Remakefile <<EOF
+%:
+	echo \$@ >> log
+EOF
+
+printf 'zeta.o: zeta.c b.h a.h\nalpha.o: c.h\n' | $REMAKE -r zeta.o
+test "$(cat log | tr '\n' ' ')" = "a.h b.h zeta.c "
+
+rm log
+printf 'zeta.o: zeta.c b.h a.h\nalpha.o: c.h\n' | $REMAKE -r
+test "$(cat log)" = c.h
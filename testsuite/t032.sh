@@ -0,0 +1,48 @@
+#!/bin/sh
+
+# Check that rules are parsed the same way from a mapped file and from a
+# stream, i.e. a pipe, which cannot be mapped.
+
+cat > rules <<EOF
+# Comment.
+V = a "b c" d+e
+V += f
+W=x+y
+X+=1 2
+Y = c++ g+ "q\\"uote"
+
+all: one two.out "sp ace" sub/three
+	echo \$^ > \$@
+	echo '\$(V) \$(W) \$(X) \$(Y)' >> \$@
+
+	echo '\$(addprefix <,\$(V))' >> \$@
+
+one: \\
+  a \\
+	b
+ 	echo \$@ \$< > \$@
+
+%.out: %.in
+	echo '\$* \$<' > \$@
+
+"sp ace" sub/three:
+	mkdir -p sub
+	echo "\$@" > "sp ace"
+	touch sub/three
+
+a b two.in:
+	touch a b two.in
+EOF
+printf '\nlast:\n\techo last > last' >> rules
+
+cp rules Remakefile
+$REMAKE -s -d all last > scripts1 2>&1
+cat all last > built1
+rm -rf all last one two.out two.in a b "sp ace" sub Remakefile .remake*
+
+cat rules | $REMAKE -s -d -f /dev/stdin all last > scripts2 2>&1
+cat all last > built2
+
+test -s scripts1
+cmp scripts1 scripts2
+cmp built1 built2
@@ -0,0 +1,42 @@
+#!/bin/sh
+
+# Check the substitutions in scripts on their edge cases.
+
+cat > Remakefile <<EOF
+V = v1 v2
+P = <
+
+t1:
+	echo '\$\$HOME \$\$\$\$' > \$@
+
+t2:
+	echo \$x \$% \$@.x > \$@
+
+t3:
+	echo pre\$(V)post \$(V)\$(V) > \$@
+
+t4:
+	echo '\$(addprefix \$(P),\$(addsuffix .c,x y))' > \$@
+
+t5:
+	echo \$(V
+	touch \$@
+
+t6:
+	echo \$(V)\$
+EOF
+# No final newline, so that the last dollar ends the script.
+printf '\techo end$' >> Remakefile
+
+$REMAKE t1 t2 t3 t4
+test "$(cat t1)" = '$HOME $$'
+test "$(cat t2)" = '$% t2.x'
+test "$(cat t3)" = 'prev1 v2post v1 v2v1 v2'
+test "$(cat t4)" = '<x.c <y.c'
+
+# A syntax error makes the script fail.
+! $REMAKE t5
+test ! -f t5
+
+test "$($REMAKE -s t6)" = 'v1 v2$
+end$'